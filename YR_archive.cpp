@@ -0,0 +1,378 @@
+/**
+ * @file YR_archive.cpp
+ * @brief Record and replay archive of responses from yr.no
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <zlib.h>
+
+#include "YR_archive.h"
+#include "YR_endian.h"
+
+/** Archive layout, all integers little endian:
+ * file header   "YRARC01\0"
+ * record        u32 magic, u64 offset_ms, u32 duration_ms, u32 http_status,
+ *               u32 url_len, u32 headers_len, u32 body_len, u32 compressed_len,
+ *               url, zlib compressed headers followed by body
+ * index         u32 count, then per record u64 file_offset, u64 offset_ms,
+ *               u32 duration_ms, u32 http_status, u32 url_len, url
+ * footer        u64 index offset, "YRIDX01\0"
+ */
+
+namespace yr
+{
+    static const char _file_magic[8] = {'Y', 'R', 'A', 'R', 'C', '0', '1', '\0'};
+    static const char _index_magic[8] = {'Y', 'R', 'I', 'D', 'X', '0', '1', '\0'};
+    static const uint32_t _record_magic = 0x43525259; // "YRRC"
+    static const size_t _record_header_size = 36;
+    static const size_t _footer_size = 16;
+    // zlib never inflates by more than about 1032 to 1
+    static const uint64_t _max_inflation = 1040;
+
+    ArchiveWriter::ArchiveWriter(const std::string &path)
+        : _file{path, std::ios::binary | std::ios::trunc}
+        , _started{std::chrono::steady_clock::now()}
+    {
+        if (!_file)
+        {
+            std::cout << "Failed to open archive for writing: " << path << std::endl;
+            return;
+        }
+        _file.write(_file_magic, sizeof(_file_magic));
+        _file_offset = sizeof(_file_magic);
+    }
+
+    ArchiveWriter::~ArchiveWriter()
+    {
+        close();
+    }
+
+    bool ArchiveWriter::isOpen() const
+    {
+        return _file.is_open();
+    }
+
+    bool ArchiveWriter::append(const ArchiveRecord &record)
+    {
+        // zlib is most of the cost of a record, run it before taking the
+        // lock so fetch threads recording at once only queue for the writes
+        std::string raw = record.headers + record.body;
+        uLongf compressed_size = compressBound(raw.size());
+        std::string compressed(compressed_size, '\0');
+        if (compress2(reinterpret_cast<Bytef *>(&compressed[0]), &compressed_size,
+                      reinterpret_cast<const Bytef *>(raw.data()), raw.size(),
+                      Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+            return false;
+        }
+        compressed.resize(compressed_size);
+
+        std::string header;
+        putU32(header, _record_magic);
+        putU64(header, record.offset_ms);
+        putU32(header, record.duration_ms);
+        putU32(header, static_cast<uint32_t>(record.http_status));
+        putU32(header, static_cast<uint32_t>(record.url.size()));
+        putU32(header, static_cast<uint32_t>(record.headers.size()));
+        putU32(header, static_cast<uint32_t>(record.body.size()));
+        putU32(header, static_cast<uint32_t>(compressed.size()));
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_file.is_open())
+        {
+            return false;
+        }
+        _file.write(header.data(), header.size());
+        _file.write(record.url.data(), record.url.size());
+        _file.write(compressed.data(), compressed.size());
+        // Flush so a recording cut short by a crash can still be scanned
+        _file.flush();
+        if (!_file)
+        {
+            return false;
+        }
+        ArchiveEntry entry = {record.url, _file_offset, record.offset_ms, record.duration_ms,
+                              static_cast<uint32_t>(record.http_status)};
+        _index.push_back(entry);
+        _file_offset += header.size() + record.url.size() + compressed.size();
+        return true;
+    }
+
+    void ArchiveWriter::close()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_file.is_open())
+        {
+            return;
+        }
+        std::string index;
+        putU32(index, static_cast<uint32_t>(_index.size()));
+        for (const ArchiveEntry &entry : _index)
+        {
+            putU64(index, entry.file_offset);
+            putU64(index, entry.offset_ms);
+            putU32(index, entry.duration_ms);
+            putU32(index, entry.http_status);
+            putU32(index, static_cast<uint32_t>(entry.url.size()));
+            index += entry.url;
+        }
+        putU64(index, _file_offset);
+        index.append(_index_magic, sizeof(_index_magic));
+        _file.write(index.data(), index.size());
+        _file.close();
+    }
+
+    size_t ArchiveWriter::size()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _index.size();
+    }
+
+    uint64_t ArchiveWriter::elapsedMs() const
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - _started).count();
+    }
+
+    ArchiveReader::ArchiveReader(const std::string &path)
+        : _file{path, std::ios::binary}
+    {
+        if (!_file)
+        {
+            std::cout << "Failed to open archive for reading: " << path << std::endl;
+            return;
+        }
+        _file.seekg(0, std::ios::end);
+        uint64_t file_size = static_cast<uint64_t>(_file.tellg());
+        _file_size = file_size;
+        char magic[sizeof(_file_magic)];
+        _file.seekg(0);
+        if (file_size < sizeof(magic) || !_file.read(magic, sizeof(magic)) ||
+            std::memcmp(magic, _file_magic, sizeof(magic)) != 0)
+        {
+            std::cout << "Not an archive file: " << path << std::endl;
+            return;
+        }
+        // No index if the writer never closed, recover what was written
+        if (!loadIndex(file_size) && !scanRecords(file_size))
+        {
+            std::cout << "Archive is corrupt: " << path << std::endl;
+            return;
+        }
+        for (size_t i = 0; i < _index.size(); i++)
+        {
+            _by_url[_index[i].url].first.push_back(i);
+        }
+        _open = true;
+    }
+
+    bool ArchiveReader::loadIndex(uint64_t file_size)
+    {
+        if (file_size < sizeof(_file_magic) + _footer_size)
+        {
+            return false;
+        }
+        char footer[_footer_size];
+        _file.clear();
+        _file.seekg(file_size - _footer_size);
+        if (!_file.read(footer, sizeof(footer)) ||
+            std::memcmp(footer + 8, _index_magic, sizeof(_index_magic)) != 0)
+        {
+            return false;
+        }
+        uint64_t index_offset = getU64(footer);
+        if (index_offset < sizeof(_file_magic) || index_offset > file_size - _footer_size)
+        {
+            return false;
+        }
+        std::string index(file_size - _footer_size - index_offset, '\0');
+        _file.seekg(index_offset);
+        if (index.size() < 4 || !_file.read(&index[0], index.size()))
+        {
+            return false;
+        }
+        uint32_t count = getU32(index.data());
+        size_t position = 4;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (position + 28 > index.size())
+            {
+                return false;
+            }
+            ArchiveEntry entry;
+            entry.file_offset = getU64(index.data() + position);
+            entry.offset_ms = getU64(index.data() + position + 8);
+            entry.duration_ms = getU32(index.data() + position + 16);
+            entry.http_status = getU32(index.data() + position + 20);
+            uint32_t url_size = getU32(index.data() + position + 24);
+            position += 28;
+            if (position + url_size > index.size())
+            {
+                return false;
+            }
+            entry.url = index.substr(position, url_size);
+            position += url_size;
+            _index.push_back(entry);
+        }
+        return true;
+    }
+
+    bool ArchiveReader::scanRecords(uint64_t file_size)
+    {
+        _index.clear();
+        uint64_t position = sizeof(_file_magic);
+        char header[_record_header_size];
+        while (position + _record_header_size <= file_size)
+        {
+            _file.clear();
+            _file.seekg(position);
+            if (!_file.read(header, sizeof(header)) || getU32(header) != _record_magic)
+            {
+                break;
+            }
+            uint32_t url_size = getU32(header + 20);
+            uint32_t compressed_size = getU32(header + 32);
+            uint64_t record_size = _record_header_size + url_size + compressed_size;
+            // A record cut short by a crash ends the scan
+            if (position + record_size > file_size)
+            {
+                break;
+            }
+            ArchiveEntry entry;
+            entry.file_offset = position;
+            entry.offset_ms = getU64(header + 4);
+            entry.duration_ms = getU32(header + 12);
+            entry.http_status = getU32(header + 16);
+            entry.url.resize(url_size);
+            if (url_size > 0 && !_file.read(&entry.url[0], url_size))
+            {
+                break;
+            }
+            _index.push_back(entry);
+            position += record_size;
+        }
+        return true;
+    }
+
+    bool ArchiveReader::isOpen() const
+    {
+        return _open;
+    }
+
+    size_t ArchiveReader::size() const
+    {
+        return _index.size();
+    }
+
+    const std::vector<ArchiveEntry> &ArchiveReader::entries() const
+    {
+        return _index;
+    }
+
+    bool ArchiveReader::read(size_t index, ArchiveRecord &record)
+    {
+        if (index >= _index.size())
+        {
+            return false;
+        }
+        char header[_record_header_size];
+        std::string url;
+        std::string compressed;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _file.clear();
+            _file.seekg(_index[index].file_offset);
+            if (!_file.read(header, sizeof(header)) || getU32(header) != _record_magic)
+            {
+                return false;
+            }
+            // Sizes come from the file, check they fit before allocating
+            uint64_t record_end = _index[index].file_offset + _record_header_size +
+                getU32(header + 20) + getU32(header + 32);
+            uint64_t raw_size = static_cast<uint64_t>(getU32(header + 24)) + getU32(header + 28);
+            if (record_end > _file_size ||
+                raw_size > static_cast<uint64_t>(getU32(header + 32)) * _max_inflation + 64)
+            {
+                return false;
+            }
+            url.resize(getU32(header + 20));
+            compressed.resize(getU32(header + 32));
+            if ((!url.empty() && !_file.read(&url[0], url.size())) ||
+                (!compressed.empty() && !_file.read(&compressed[0], compressed.size())))
+            {
+                return false;
+            }
+        }
+        // Decompress outside the lock
+        uint32_t headers_size = getU32(header + 24);
+        uint32_t body_size = getU32(header + 28);
+        std::string raw(static_cast<size_t>(headers_size) + body_size, '\0');
+        uLongf raw_size = raw.size();
+        if (!raw.empty() &&
+            (uncompress(reinterpret_cast<Bytef *>(&raw[0]), &raw_size,
+                        reinterpret_cast<const Bytef *>(compressed.data()),
+                        compressed.size()) != Z_OK || raw_size != raw.size()))
+        {
+            return false;
+        }
+        record.url = url;
+        record.offset_ms = getU64(header + 4);
+        record.duration_ms = getU32(header + 12);
+        record.http_status = getU32(header + 16);
+        record.headers = raw.substr(0, headers_size);
+        record.body = raw.substr(headers_size);
+        return true;
+    }
+
+    bool ArchiveReader::find(const std::string &url, ArchiveRecord &record)
+    {
+        size_t index;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it = _by_url.find(url);
+            if (it == _by_url.end())
+            {
+                return false;
+            }
+            std::pair<std::vector<size_t>, size_t> &records = it->second;
+            index = records.first[records.second];
+            records.second = (records.second + 1) % records.first.size();
+        }
+        return read(index, record);
+    }
+
+    void ArchiveReader::replay(double speed,
+                               const std::function<void(const ArchiveRecord &)> &callback)
+    {
+        // Records are written as responses finish, play them in start order
+        std::vector<size_t> order(_index.size());
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b)
+        {
+            return _index[a].offset_ms < _index[b].offset_ms;
+        });
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ArchiveRecord record;
+        for (size_t index : order)
+        {
+            if (speed > 0.0)
+            {
+                std::chrono::duration<double, std::milli> due(_index[index].offset_ms / speed);
+                std::this_thread::sleep_until(start +
+                    std::chrono::duration_cast<std::chrono::steady_clock::duration>(due));
+            }
+            if (read(index, record))
+            {
+                callback(record);
+            }
+        }
+    }
+
+} // namespace yr
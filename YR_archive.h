@@ -0,0 +1,177 @@
+/**
+ * @file YR_archive.h
+ * @brief Record and replay archive of responses from yr.no
+ *
+ * Every recorded response keeps its URL, HTTP status, headers, when it was
+ * made and how long it took, with the headers and body zlib compressed.
+ * An index of the records is written at the end of the file on close so a
+ * reader can find responses by URL without reading the bodies.
+ */
+
+#ifndef YR_ARCHIVE_H
+#define YR_ARCHIVE_H
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+namespace yr
+{
+    /**
+     * @brief Structure containing one recorded response
+     */
+    struct ArchiveRecord
+    {
+        std::string url;
+        long http_status = 0;
+        std::string headers; // Raw response headers
+        uint64_t offset_ms = 0; // When the request started, since recording began
+        uint32_t duration_ms = 0; // How long the response took
+        std::string body;
+    };
+
+    /**
+     * @brief Structure containing the index entry for one record
+     */
+    struct ArchiveEntry
+    {
+        std::string url;
+        uint64_t file_offset; // Where the record starts in the file
+        uint64_t offset_ms;
+        uint32_t duration_ms;
+        uint32_t http_status;
+    };
+
+    /**
+     * @brief Class to record responses to an archive file
+     */
+    class ArchiveWriter
+    {
+
+    public:
+    /**
+     * @brief Construct a new ArchiveWriter object, replacing any file at path
+     * @param path Archive file to write
+     */
+        explicit ArchiveWriter(const std::string &path);
+
+    /**
+     * @brief Destructor, writes the index if not already closed
+     */
+        ~ArchiveWriter();
+
+        ArchiveWriter(const ArchiveWriter &) = delete;
+        ArchiveWriter &operator=(const ArchiveWriter &) = delete;
+
+    /**
+     * @brief True if the file could be opened
+     */
+        bool isOpen() const;
+
+    /**
+     * @brief Append a record, safe to call from several threads
+     * @return bool False if the archive is closed or the write failed
+     */
+        bool append(const ArchiveRecord &record);
+
+    /**
+     * @brief Write the index and close the file
+     */
+        void close();
+
+    /**
+     * @brief Number of records written
+     */
+        size_t size();
+
+    /**
+     * @brief Milliseconds since recording began, for ArchiveRecord::offset_ms
+     */
+        uint64_t elapsedMs() const;
+
+    private:
+        std::mutex _mutex;
+        std::ofstream _file;
+        uint64_t _file_offset = 0;
+        std::vector<ArchiveEntry> _index;
+        std::chrono::steady_clock::time_point _started;
+    };
+
+    /**
+     * @brief Class to read and replay an archive file
+     */
+    class ArchiveReader
+    {
+
+    public:
+    /**
+     * @brief Construct a new ArchiveReader object
+     *
+     * Loads the index, or rebuilds it by scanning the records if the
+     * writer never closed the file.
+     * @param path Archive file to read
+     */
+        explicit ArchiveReader(const std::string &path);
+
+        ArchiveReader(const ArchiveReader &) = delete;
+        ArchiveReader &operator=(const ArchiveReader &) = delete;
+
+    /**
+     * @brief True if the file could be opened and read
+     */
+        bool isOpen() const;
+
+    /**
+     * @brief Number of records in the archive
+     */
+        size_t size() const;
+
+    /**
+     * @brief Index entries of every record, in recorded order
+     */
+        const std::vector<ArchiveEntry> &entries() const;
+
+    /**
+     * @brief Read the record at a position in the archive
+     * @return bool False if out of range or the record is corrupt
+     */
+        bool read(size_t index, ArchiveRecord &record);
+
+    /**
+     * @brief Read the next recorded response for a URL
+     *
+     * Successive calls for the same URL step through its responses in
+     * recorded order, starting again from the first after the last.
+     * @return bool False if the URL was never recorded
+     */
+        bool find(const std::string &url, ArchiveRecord &record);
+
+    /**
+     * @brief Hand every record to callback at its recorded start time
+     * @param speed Playback speed, 2.0 for twice as fast, 0 for no waiting
+     * @param callback Function receiving each record
+     */
+        void replay(double speed, const std::function<void(const ArchiveRecord &)> &callback);
+
+    private:
+        bool loadIndex(uint64_t file_size);
+        bool scanRecords(uint64_t file_size);
+
+        std::mutex _mutex;
+        std::ifstream _file;
+        uint64_t _file_size = 0;
+        bool _open = false;
+        std::vector<ArchiveEntry> _index;
+        // Records for each URL, and which one find() returns next
+        std::map<std::string, std::pair<std::vector<size_t>, size_t>> _by_url;
+    };
+
+} // namespace yr
+
+#endif //YR_ARCHIVE_H
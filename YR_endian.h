@@ -0,0 +1,68 @@
+/**
+ * @file YR_endian.h
+ * @brief Little endian integers for the archive and history file formats
+ *
+ * Internal to the library, the files are read and written a byte at a
+ * time so they are the same whatever the host's byte order.
+ */
+
+#ifndef YR_ENDIAN_H
+#define YR_ENDIAN_H
+
+#include <cstdint>
+#include <string>
+
+
+namespace yr
+{
+    /**
+     * @brief Append a 32 bit integer to out
+     */
+    inline void putU32(std::string &out, uint32_t value)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+        }
+    }
+
+    /**
+     * @brief Append a 64 bit integer to out
+     */
+    inline void putU64(std::string &out, uint64_t value)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            out.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+        }
+    }
+
+    /**
+     * @brief Read a 32 bit integer from the 4 bytes at data
+     */
+    inline uint32_t getU32(const char *data)
+    {
+        uint32_t value = 0;
+        for (int i = 3; i >= 0; i--)
+        {
+            value = (value << 8) | static_cast<unsigned char>(data[i]);
+        }
+        return value;
+    }
+
+    /**
+     * @brief Read a 64 bit integer from the 8 bytes at data
+     */
+    inline uint64_t getU64(const char *data)
+    {
+        uint64_t value = 0;
+        for (int i = 7; i >= 0; i--)
+        {
+            value = (value << 8) | static_cast<unsigned char>(data[i]);
+        }
+        return value;
+    }
+
+} // namespace yr
+
+#endif //YR_ENDIAN_H
@@ -8,10 +8,22 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <ctime>
+#include <cstdio>
+#include <limits>
 #include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 
 #include "YR_forecast.h"
+#include "YR_archive.h"
 
 using json = nlohmann::json;
 
@@ -31,12 +43,120 @@ namespace yr
         return size * nmemb;
     }
 
-    // Storage for data returned from yr.no
-    static std::string _forecast_data;
     json _forecast_data_json;
 
-    // Buffer to store curl error strings
-    static char errorBuffer[CURL_ERROR_SIZE];
+    // Fetches in flight, shared by every YrForecast in the process
+    static SingleFlight<YrForecastStruct> _forecast_flight;
+
+    // Settings new YrForecast objects start with
+    static std::mutex _default_options_mutex;
+    static FetchOptions _default_fetch_options;
+
+    // Recent request latencies in ms, shared by every YrForecast in the process
+    static struct LatencyTracker
+    {
+        static const size_t capacity = 256;
+        std::mutex mutex;
+        double samples[capacity];
+        size_t count = 0;
+        size_t next = 0;
+
+        void add(double latency_ms)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            samples[next] = latency_ms;
+            next = (next + 1) % capacity;
+            count = count < capacity ? count + 1 : capacity;
+        }
+
+        // False until min_samples latencies have been seen
+        bool percentile(double fraction, size_t min_samples, double &latency_ms)
+        {
+            std::vector<double> sorted;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (count == 0 || count < min_samples)
+                {
+                    return false;
+                }
+                sorted.assign(samples, samples + count);
+            }
+            fraction = std::min(std::max(fraction, 0.0), 1.0);
+            size_t index = static_cast<size_t>(fraction * (sorted.size() - 1));
+            std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+            latency_ms = sorted[index];
+            return true;
+        }
+    } _request_latency;
+
+    static double millisecondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Whether a failed request is worth another attempt
+    static bool isRetryable(const FetchResult &result)
+    {
+        if (result.status == FetchStatus::HttpError)
+        {
+            // Rate limited or server side trouble
+            return result.http_status == 429 || result.http_status >= 500;
+        }
+        if (result.status != FetchStatus::TransferFailed)
+        {
+            return false;
+        }
+        switch (result.curl_code)
+        {
+            case CURLE_OPERATION_TIMEDOUT:
+            case CURLE_COULDNT_RESOLVE_HOST:
+            case CURLE_COULDNT_CONNECT:
+            case CURLE_SSL_CONNECT_ERROR:
+            case CURLE_SEND_ERROR:
+            case CURLE_RECV_ERROR:
+            case CURLE_GOT_NOTHING:
+            case CURLE_PARTIAL_FILE:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Wait before the next attempt, exponential with full jitter so a
+    // batch of failed requests doesn't retry in lockstep
+    static std::chrono::milliseconds backoffDelay(const FetchOptions &options, int attempt)
+    {
+        static thread_local std::mt19937 generator(std::random_device{}());
+        double limit = static_cast<double>(options.backoff_base_ms) *
+            std::pow(2.0, static_cast<double>(attempt - 1));
+        limit = std::min(limit, static_cast<double>(options.backoff_max_ms));
+        std::uniform_real_distribution<double> distribution(0.0, std::max(limit, 0.0));
+        return std::chrono::milliseconds(static_cast<long>(distribution(generator)));
+    }
+
+    // Turn a finished transfer into a result, body is left to the caller
+    static void finishTransfer(CURL *easyhandle, CURLcode code, const char *error_buffer,
+                               FetchResult &result)
+    {
+        result.curl_code = code;
+        if (code != CURLE_OK)
+        {
+            result.status = FetchStatus::TransferFailed;
+            result.error = std::string("Curl request not successful, error: ") +
+                (error_buffer[0] != '\0' ? error_buffer : curl_easy_strerror(code));
+            return;
+        }
+        curl_easy_getinfo(easyhandle, CURLINFO_RESPONSE_CODE, &result.http_status);
+        if (result.http_status >= 400)
+        {
+            result.status = FetchStatus::HttpError;
+            result.error = "Request to yr.no failed with HTTP status " +
+                std::to_string(result.http_status) + ".";
+            return;
+        }
+        result.status = FetchStatus::Ok;
+    }
 
     YrForecast::YrForecast(const float &latitude, 
                     const float &longitude, 
@@ -45,6 +165,7 @@ namespace yr
                     , _longitude{longitude}
                     , _altitude{altitude} 
                     {
+                        _fetch_options = defaultFetchOptions();
                         // Init curl handle
                         curlInit();
                     }
@@ -53,13 +174,15 @@ namespace yr
     {
     /** Yr.no API requires URL of the form:
      * https://api.met.no/weatherapi/locationforecast/2.0/compact.json?altitude=X&lat=Y&lon=Z
+     * or complete.json for the complete product
      */
+        std::string product = _product == ForecastProduct::Complete ? "complete.json?" : "compact.json?";
         // Set coords as string
         std::string alt = "altitude=" + std::to_string(_altitude);
         std::string lat = "&lat=" + std::to_string(_latitude);
         std::string lon = "&lon=" + std::to_string(_longitude);
         // Set URL based on the user input coords
-        _coords_url = _base_url + alt + lat + lon;
+        _coords_url = _base_url + product + alt + lat + lon;
         _URL_complete = true;
         return;
     }
@@ -81,8 +204,14 @@ namespace yr
      */
     void YrForecast::curlCleanUp()
     {
-        // Clean up curl easy handle
+        // Clean up curl easy handles
         curl_easy_cleanup(_easyhandle);
+        _easyhandle = NULL;
+        if (_hedge_handle != NULL)
+        {
+            curl_easy_cleanup(_hedge_handle);
+            _hedge_handle = NULL;
+        }
 
         // Clean global environment in the case easy clean up is not executed
         curl_global_cleanup();
@@ -96,64 +225,281 @@ namespace yr
     {
         if (_curl_init)
         {
-            static std::string forecast;
             // Only need to made request if URL exists
             if (_URL_complete)
             {
-                // Check handle has been created
-                if (easyhandle == NULL)
+                FetchResult result = fetchForecastData(url, easyhandle);
+                code = result.curl_code;
+                _code = code;
+                if (!result.ok())
+                {
+                    std::cout << result.error << std::endl;
+                    return "Error, " + result.error + "\n";
+                }
+                return result.body;
+            }
+            return "Error, require URL to make curl request.\n";
+        }
+        return "Error, curl handle has not been initialised.\n";
+    }
+
+    yr::FetchResult YrForecast::fetchForecastData(const std::string &url, CURL *easyhandle)
+    {
+        FetchResult result;
+        // Replay stands in for curl entirely
+        if (_fetch_options.replay)
+        {
+            return replayRequest(url);
+        }
+        if (!_curl_init || easyhandle == NULL)
+        {
+            result.status = FetchStatus::NotInitialised;
+            result.error = "Failed to create CURL connection.";
+            return result;
+        }
+        if (url.empty())
+        {
+            result.status = FetchStatus::NoURL;
+            result.error = "Require URL to make curl request.";
+            return result;
+        }
+        int max_attempts = _fetch_options.max_attempts > 0 ? _fetch_options.max_attempts : 1;
+        for (int attempt = 1; ; attempt++)
+        {
+            result = performAttempt(url, easyhandle);
+            result.attempts = attempt;
+            if (result.ok() || !isRetryable(result) || attempt >= max_attempts)
+            {
+                return result;
+            }
+            std::this_thread::sleep_for(backoffDelay(_fetch_options, attempt));
+        }
+    }
+
+    bool YrForecast::setupTransfer(CURL *easyhandle, const std::string &url, std::string *body,
+                                   std::string *headers, char *error_buffer, std::string &error)
+    {
+        error_buffer[0] = '\0';
+        // Set buffer for curl errors
+        if (curl_easy_setopt(easyhandle, CURLOPT_ERRORBUFFER, error_buffer) != CURLE_OK)
+        {
+            error = "Failed to set error buffer.";
+            return false;
+        }
+        // Set the URL
+        if (curl_easy_setopt(easyhandle, CURLOPT_URL, url.c_str()) != CURLE_OK)
+        {
+            error = std::string("Failed to set the URL. ") + error_buffer;
+            return false;
+        }
+        // Set User Agent
+        if (curl_easy_setopt(easyhandle, CURLOPT_USERAGENT, userAgent.c_str()) != CURLE_OK)
+        {
+            error = std::string("Failed to set User Agent. ") + error_buffer;
+            return false;
+        }
+        // Set timeouts, signals can't be used for them in a threaded program
+        if (curl_easy_setopt(easyhandle, CURLOPT_NOSIGNAL, 1L) != CURLE_OK ||
+            curl_easy_setopt(easyhandle, CURLOPT_CONNECTTIMEOUT_MS,
+                             _fetch_options.connect_timeout_ms) != CURLE_OK ||
+            curl_easy_setopt(easyhandle, CURLOPT_TIMEOUT_MS,
+                             _fetch_options.total_timeout_ms) != CURLE_OK)
+        {
+            error = std::string("Failed to set timeouts. ") + error_buffer;
+            return false;
+        }
+        // Set the write callback in the curl handler
+        if (curl_easy_setopt(easyhandle, CURLOPT_WRITEFUNCTION, dataWriterCallback) != CURLE_OK)
+        {
+            error = std::string("Failed to set write function: ") + error_buffer;
+            return false;
+        }
+        // Set the forecast data storage in the handler
+        if (curl_easy_setopt(easyhandle, CURLOPT_WRITEDATA, body) != CURLE_OK)
+        {
+            error = std::string("Failed to set the write data: ") + error_buffer;
+            return false;
+        }
+        // Keep the headers only when recording, NULL drops them
+        if (curl_easy_setopt(easyhandle, CURLOPT_HEADERFUNCTION,
+                             headers != NULL ? dataWriterCallback : NULL) != CURLE_OK ||
+            curl_easy_setopt(easyhandle, CURLOPT_HEADERDATA, headers) != CURLE_OK)
+        {
+            error = std::string("Failed to set the header data: ") + error_buffer;
+            return false;
+        }
+        return true;
+    }
+
+    void YrForecast::clearTransfer(CURL *easyhandle)
+    {
+        // Back to libcurl's defaults, the write callback included since it
+        // would be handed a NULL string
+        curl_easy_setopt(easyhandle, CURLOPT_WRITEFUNCTION, static_cast<curl_write_callback>(NULL));
+        curl_easy_setopt(easyhandle, CURLOPT_WRITEDATA, static_cast<void *>(NULL));
+        curl_easy_setopt(easyhandle, CURLOPT_HEADERFUNCTION, static_cast<curl_write_callback>(NULL));
+        curl_easy_setopt(easyhandle, CURLOPT_HEADERDATA, static_cast<void *>(NULL));
+        curl_easy_setopt(easyhandle, CURLOPT_ERRORBUFFER, static_cast<char *>(NULL));
+    }
+
+    yr::FetchResult YrForecast::performAttempt(const std::string &url, CURL *easyhandle)
+    {
+        // Only hedge once there are enough latencies to say what slow is
+        double hedge_after_ms = 0.0;
+        if (_fetch_options.hedge &&
+            _request_latency.percentile(_fetch_options.hedge_percentile,
+                                        _fetch_options.hedge_min_samples, hedge_after_ms))
+        {
+            return performHedged(url, easyhandle, hedge_after_ms);
+        }
+
+        FetchResult result;
+        std::string body;
+        std::string headers;
+        std::string *headers_ptr = _fetch_options.record ? &headers : NULL;
+        if (!setupTransfer(easyhandle, url, &body, headers_ptr, _error_buffer, result.error))
+        {
+            clearTransfer(easyhandle);
+            result.status = FetchStatus::SetupFailed;
+            return result;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint64_t record_offset_ms = _fetch_options.record ? _fetch_options.record->elapsedMs() : 0;
+        // Send request to yr.no
+        CURLcode code = curl_easy_perform(easyhandle);
+        finishTransfer(easyhandle, code, _error_buffer, result);
+        clearTransfer(easyhandle);
+        double duration_ms = millisecondsSince(start);
+        if (_fetch_options.record)
+        {
+            recordTransfer(url, result, headers, body, record_offset_ms, duration_ms);
+        }
+        if (result.ok())
+        {
+            _request_latency.add(duration_ms);
+            result.body = std::move(body);
+        }
+        return result;
+    }
+
+    yr::FetchResult YrForecast::performHedged(const std::string &url, CURL *easyhandle,
+                                              double hedge_after_ms)
+    {
+        FetchResult result;
+        std::string bodies[2];
+        std::string headers[2];
+        bool recording = static_cast<bool>(_fetch_options.record);
+        char *error_buffers[2] = {_error_buffer, _hedge_error_buffer};
+        CURL *handles[2] = {easyhandle, NULL};
+        uint64_t record_offset_ms = recording ? _fetch_options.record->elapsedMs() : 0;
+        if (!setupTransfer(easyhandle, url, &bodies[0], recording ? &headers[0] : NULL,
+                           _error_buffer, result.error))
+        {
+            clearTransfer(easyhandle);
+            result.status = FetchStatus::SetupFailed;
+            return result;
+        }
+        CURLM *multi = curl_multi_init();
+        if (multi == NULL || curl_multi_add_handle(multi, easyhandle) != CURLM_OK)
+        {
+            clearTransfer(easyhandle);
+            result.status = FetchStatus::SetupFailed;
+            result.error = "Failed to create CURL multi handle.";
+            curl_multi_cleanup(multi);
+            return result;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool attached[2] = {true, false};
+        bool hedge_tried = false;
+        bool done = false;
+        while (!done)
+        {
+            int running = 0;
+            curl_multi_perform(multi, &running);
+            int queued = 0;
+            CURLMsg *message;
+            while (!done && (message = curl_multi_info_read(multi, &queued)) != NULL)
+            {
+                if (message->msg != CURLMSG_DONE)
                 {
-                    std::cout << "Failed to create CURL connection." << std::endl;
-                    exit(EXIT_FAILURE);
+                    continue;
                 }
-                // Set buffer for curl errors
-                code = curl_easy_setopt(easyhandle, CURLOPT_ERRORBUFFER, errorBuffer);
-                if (code != CURLE_OK)
+                int which = message->easy_handle == handles[0] ? 0 : 1;
+                FetchResult attempt;
+                finishTransfer(handles[which], message->data.result, error_buffers[which], attempt);
+                curl_multi_remove_handle(multi, handles[which]);
+                attached[which] = false;
+                attempt.hedged = handles[1] != NULL;
+                // First success wins, a failure only counts once nothing is left running
+                if (recording)
                 {
-                    std::cout << "Failed to set error buffer " << code << std::endl;
-                    exit(EXIT_FAILURE);
+                    recordTransfer(url, attempt, headers[which], bodies[which],
+                                   record_offset_ms, millisecondsSince(start));
                 }
-                // Set the URL
-                code = curl_easy_setopt(easyhandle, CURLOPT_URL, url.c_str());
-                if (code != CURLE_OK)
+                if (attempt.ok())
                 {
-                    std::cout << "Failed to set the URL. " << errorBuffer << std::endl;
-                    exit(EXIT_FAILURE);
+                    _request_latency.add(millisecondsSince(start));
+                    attempt.body = std::move(bodies[which]);
+                    result = attempt;
+                    done = true;
                 }
-                // Set User Agent
-                code = curl_easy_setopt(easyhandle, CURLOPT_USERAGENT,
-                                        &userAgent);
-                if (code != CURLE_OK)
+                else
                 {
-                    std::cout << "Failed to set User Agent. " << errorBuffer << std::endl;
-                    exit(EXIT_FAILURE);
+                    // Includes the primary failing before the hedge was due,
+                    // the retry loop decides what happens next
+                    result = attempt;
+                    done = !attached[1 - which];
                 }
-                // Set the write callback in the curl handler
-                code = curl_easy_setopt(easyhandle, CURLOPT_WRITEFUNCTION, dataWriterCallback);
-                if (code != CURLE_OK)
+            }
+            if (done)
+            {
+                break;
+            }
+            double elapsed_ms = millisecondsSince(start);
+            if (!hedge_tried && elapsed_ms >= hedge_after_ms)
+            {
+                hedge_tried = true;
+                if (_hedge_handle == NULL)
                 {
-                    std::cout << "Failed to set write function: " << errorBuffer;
-                    exit(EXIT_FAILURE);
+                    _hedge_handle = curl_easy_init();
                 }
-                // Set the forecast data storage in the handler
-                code = curl_easy_setopt(easyhandle, CURLOPT_WRITEDATA, &forecast);
-                if (code != CURLE_OK)
+                std::string hedge_error;
+                // Without a second handle carry on with the primary alone
+                if (_hedge_handle != NULL &&
+                    setupTransfer(_hedge_handle, url, &bodies[1], recording ? &headers[1] : NULL,
+                                  _hedge_error_buffer, hedge_error) &&
+                    curl_multi_add_handle(multi, _hedge_handle) == CURLM_OK)
                 {
-                    std::cout << "Failed to set the write data: " << errorBuffer;
-                    exit(EXIT_FAILURE);
+                    handles[1] = _hedge_handle;
+                    attached[1] = true;
                 }
-                // Send request to yr.no
-                code = curl_easy_perform(easyhandle);
-                if (code != CURLE_OK)
+                else if (_hedge_handle != NULL)
                 {
-                    std::cout << "Curl request not successful, error: " << errorBuffer;
-                    exit(EXIT_FAILURE);
+                    clearTransfer(_hedge_handle);
                 }
-                return forecast;
+                continue;
             }
-            return "Error, require URL to make curl request.\n";
+            // Wake for socket activity, or when the hedge is due
+            long wait_ms = 100;
+            if (!hedge_tried && hedge_after_ms - elapsed_ms < wait_ms)
+            {
+                wait_ms = static_cast<long>(hedge_after_ms - elapsed_ms) + 1;
+            }
+            curl_multi_wait(multi, NULL, 0, static_cast<int>(wait_ms), NULL);
         }
-        return "Error, curl handle has not been initialised.\n";
+        for (int i = 0; i < 2; i++)
+        {
+            if (attached[i])
+            {
+                curl_multi_remove_handle(multi, handles[i]);
+            }
+            if (handles[i] != NULL)
+            {
+                clearTransfer(handles[i]);
+            }
+        }
+        curl_multi_cleanup(multi);
+        return result;
     }
 
     yr::YrForecastStruct YrForecast::parseForecastJSON(std::string forecast)
@@ -187,6 +533,70 @@ namespace yr
         return weather;   
     }
 
+    int64_t YrForecast::parseTimestamp(const std::string &timestamp)
+    {
+        struct tm fields = {};
+        if (sscanf(timestamp.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d", &fields.tm_year, &fields.tm_mon,
+                   &fields.tm_mday, &fields.tm_hour, &fields.tm_min, &fields.tm_sec) != 6)
+        {
+            throw std::runtime_error("bad timestamp " + timestamp);
+        }
+        fields.tm_year -= 1900;
+        fields.tm_mon -= 1;
+        return static_cast<int64_t>(timegm(&fields));
+    }
+
+    static float detailOrNaN(const json &details, const char *name)
+    {
+        auto it = details.find(name);
+        if (it == details.end() || !it->is_number())
+        {
+            return std::numeric_limits<float>::quiet_NaN();
+        }
+        return it->get<float>();
+    }
+
+    yr::YrForecastSeries YrForecast::parseForecastSeries(const std::string &forecast)
+    {
+        json forecast_json = json::parse(forecast, nullptr, false);
+        if (forecast_json.is_discarded() || !forecast_json.is_object())
+        {
+            throw std::runtime_error("forecast data is not JSON");
+        }
+        yr::YrForecastSeries series;
+        auto properties = forecast_json.find("properties");
+        if (properties == forecast_json.end() || !properties->contains("timeseries") ||
+            !(*properties)["meta"]["updated_at"].is_string())
+        {
+            throw std::runtime_error("forecast data has no timeseries");
+        }
+        series.issue_time = parseTimestamp((*properties)["meta"]["updated_at"].get<std::string>());
+        const json &timeseries = (*properties)["timeseries"];
+        series.points.reserve(timeseries.size());
+        for (const json &step : timeseries)
+        {
+            const json &data = step.at("data");
+            const json &details = data.at("instant").at("details");
+            yr::YrForecastPoint point;
+            point.time = parseTimestamp(step.at("time").get<std::string>());
+            point.air_pressure_at_sea_level = detailOrNaN(details, "air_pressure_at_sea_level");
+            point.temperature = detailOrNaN(details, "air_temperature");
+            point.cloud_area_fraction = detailOrNaN(details, "cloud_area_fraction");
+            point.relative_humidity = detailOrNaN(details, "relative_humidity");
+            point.wind_direction = detailOrNaN(details, "wind_from_direction");
+            point.wind_speed = detailOrNaN(details, "wind_speed");
+            point.precipitation_amount = std::numeric_limits<float>::quiet_NaN();
+            auto next_6_hours = data.find("next_6_hours");
+            if (next_6_hours != data.end() && next_6_hours->contains("details"))
+            {
+                point.precipitation_amount =
+                    detailOrNaN((*next_6_hours)["details"], "precipitation_amount");
+            }
+            series.points.push_back(point);
+        }
+        return series;
+    }
+
     void YrForecast::printForecast()
     {
         std::cout << std::endl;
@@ -209,16 +619,141 @@ namespace yr
     std::string YrForecast::getURL(){
         return _coords_url;
     }
+    void YrForecast::setProduct(yr::ForecastProduct product)
+    {
+        _product = product;
+        // Keep an existing URL in step with the product
+        if (_URL_complete)
+        {
+            createURL();
+        }
+    }
+    yr::ForecastProduct YrForecast::getProduct()
+    {
+        return _product;
+    }
+    yr::FetchResult YrForecast::replayRequest(const std::string &url)
+    {
+        FetchResult result;
+        result.attempts = 1;
+        ArchiveRecord record;
+        if (!_fetch_options.replay->find(url, record))
+        {
+            result.status = FetchStatus::ReplayMiss;
+            result.error = "No recorded response for " + url;
+            return result;
+        }
+        // Take as long as the recorded response did, scaled by the speed
+        if (_fetch_options.replay_speed > 0.0)
+        {
+            std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(
+                record.duration_ms / _fetch_options.replay_speed));
+        }
+        result.http_status = record.http_status;
+        if (record.http_status >= 400)
+        {
+            result.status = FetchStatus::HttpError;
+            result.error = "Request to yr.no failed with HTTP status " +
+                std::to_string(record.http_status) + ".";
+            return result;
+        }
+        result.body = std::move(record.body);
+        return result;
+    }
+    void YrForecast::recordTransfer(const std::string &url, const yr::FetchResult &result,
+                                    const std::string &headers, const std::string &body,
+                                    uint64_t offset_ms, double duration_ms)
+    {
+        // Only responses can be replayed, transfer errors aren't kept
+        if (result.status != FetchStatus::Ok && result.status != FetchStatus::HttpError)
+        {
+            return;
+        }
+        ArchiveRecord record;
+        record.url = url;
+        record.http_status = result.http_status;
+        record.headers = headers;
+        record.offset_ms = offset_ms;
+        record.duration_ms = static_cast<uint32_t>(duration_ms);
+        record.body = body;
+        _fetch_options.record->append(record);
+    }
+    void YrForecast::setFetchOptions(const yr::FetchOptions &options)
+    {
+        _fetch_options = options;
+    }
+    yr::FetchOptions YrForecast::getFetchOptions()
+    {
+        return _fetch_options;
+    }
+    void YrForecast::setDefaultFetchOptions(const yr::FetchOptions &options)
+    {
+        std::lock_guard<std::mutex> lock(_default_options_mutex);
+        _default_fetch_options = options;
+    }
+    yr::FetchOptions YrForecast::defaultFetchOptions()
+    {
+        std::lock_guard<std::mutex> lock(_default_options_mutex);
+        return _default_fetch_options;
+    }
+    yr::FetchResult YrForecast::requestForecastData()
+    {
+        if (!_URL_complete)
+        {
+            createURL();
+        }
+        FetchResult result = fetchForecastData(_coords_url, _easyhandle);
+        _code = result.curl_code;
+        _forecast_data = result.body;
+        return result;
+    }
+    yr::YrForecastStruct YrForecast::fetchForecast()
+    {
+        if (!_URL_complete)
+        {
+            createURL();
+        }
+        // createURL() always writes the params in the same order and
+        // precision, so the URL itself is the normalised location. Only
+        // callers fetching the same way share a request: same archives and
+        // same timeout, retry and hedging settings, so nobody waits on
+        // another caller's budget or gets a replayed answer for a live one.
+        std::ostringstream key;
+        key << _coords_url << '|' << _fetch_options.replay.get() << '|'
+            << _fetch_options.record.get() << '|' << _fetch_options.replay_speed << '|'
+            << _fetch_options.connect_timeout_ms << '|' << _fetch_options.total_timeout_ms << '|'
+            << _fetch_options.max_attempts << '|' << _fetch_options.backoff_base_ms << '|'
+            << _fetch_options.backoff_max_ms << '|' << _fetch_options.hedge << '|'
+            << _fetch_options.hedge_percentile << '|' << _fetch_options.hedge_min_samples;
+        return _forecast_flight.run(key.str(), [this]()
+        {
+            FetchResult result = requestForecastData();
+            if (!result.ok())
+            {
+                throw std::runtime_error(result.error);
+            }
+            return parseForecastJSON(result.body);
+        });
+    }
+    yr::SingleFlightStats YrForecast::singleFlightStats()
+    {
+        return _forecast_flight.stats();
+    }
     void YrForecast::runProgram()
     {
         // Set _coords_url based on the class coordinate params
         createURL();
-        // Retrieve forecast data from yr.no
-        _forecast_data = populateForecastData(_coords_url, _easyhandle, _code);
-        // Parse forecast data into member struct
-        _current_weather = parseForecastJSON(_forecast_data);
-        // Print struct to screen
-        printForecast();
+        // Retrieve forecast data from yr.no and parse into member struct
+        try
+        {
+            _current_weather = fetchForecast();
+            // Print struct to screen
+            printForecast();
+        }
+        catch (const std::exception &e)
+        {
+            std::cout << "Failed to retrieve forecast. " << e.what() << std::endl;
+        }
         // Cleanup curl object
         curlCleanUp();
         return;
@@ -8,16 +8,25 @@
 #ifndef YR_FORECAST_H
 #define YR_FORECAST_H
 
+#include <cstdint>
+#include <iostream>
+#include <memory>
 #include <string>
 #include <sstream>
 #include <iomanip>
+#include <vector>
 
 #include <nlohmann/json.hpp>
 #include <curl/curl.h>
 
+#include "YR_singleflight.h"
+
 
 namespace yr
 {
+    class ArchiveWriter;
+    class ArchiveReader;
+
     /**
     * @brief Structure containing information about the forecast
     */
@@ -33,6 +42,105 @@ namespace yr
         std::string forecast_summary;
     };
 
+    /**
+    * @brief Structure containing one step of a forecast series
+    *
+    * Fields missing from the step, such as precipitation at the end of
+    * the series, are NaN.
+    */
+    struct YrForecastPoint
+    {
+        int64_t time; // Seconds since the epoch, UTC
+        float air_pressure_at_sea_level;
+        float temperature;
+        float cloud_area_fraction;
+        float relative_humidity;
+        float wind_direction;
+        float wind_speed;
+        float precipitation_amount; // Over the next 6 hours
+    };
+
+    /**
+    * @brief Structure containing every step of one forecast run
+    */
+    struct YrForecastSeries
+    {
+        int64_t issue_time = 0; // When yr.no updated the forecast, seconds since the epoch
+        std::vector<YrForecastPoint> points;
+    };
+
+    /**
+    * @brief Location of a forecast
+    */
+    struct ForecastLocation
+    {
+        float latitude;
+        float longitude;
+        int altitude;
+    };
+
+    /**
+    * @brief Locationforecast product to request
+    */
+    enum class ForecastProduct
+    {
+        Compact, // The seven common fields
+        Complete // Adds dew point, fog, UV index, gusts and percentiles
+    };
+
+    /**
+    * @brief Outcome of a request to yr.no
+    */
+    enum class FetchStatus
+    {
+        Ok,
+        NotInitialised, // Curl handle missing
+        NoURL,
+        SetupFailed, // Curl rejected an option
+        TransferFailed, // Curl transfer error, including timeouts
+        HttpError, // Response with a 4xx or 5xx status
+        ReplayMiss // Replaying and the URL was never recorded
+    };
+
+    /**
+    * @brief Structure containing the result of a request to yr.no
+    */
+    struct FetchResult
+    {
+        FetchStatus status = FetchStatus::Ok;
+        CURLcode curl_code = CURLE_OK;
+        long http_status = 0;
+        int attempts = 0; // Attempts made, including retries
+        bool hedged = false; // A duplicate request was sent
+        std::string body; // Forecast data in JSON format when ok
+        std::string error; // Reason when not ok
+
+        bool ok() const { return status == FetchStatus::Ok; }
+    };
+
+    /**
+    * @brief Structure containing the timeout, retry and hedging settings
+    */
+    struct FetchOptions
+    {
+        long connect_timeout_ms = 5000;
+        long total_timeout_ms = 30000; // Per attempt, 0 for no limit
+        int max_attempts = 3;
+        // Retries wait a random time up to base * 2^retry, capped at max
+        long backoff_base_ms = 200;
+        long backoff_max_ms = 5000;
+        // Send a duplicate request once an attempt takes longer than this
+        // percentile of recent request latencies
+        bool hedge = false;
+        double hedge_percentile = 0.95;
+        size_t hedge_min_samples = 20; // No hedging until this many latencies seen
+        // Record every response to this archive, see YR_archive.h
+        std::shared_ptr<ArchiveWriter> record;
+        // Answer from this archive instead of yr.no
+        std::shared_ptr<ArchiveReader> replay;
+        double replay_speed = 1.0; // 2.0 answers twice as fast as recorded, 0 at once
+    };
+
     /**
      * @brief Class to request weather data from yr.no based on user input location
      */
@@ -67,7 +175,20 @@ namespace yr
     /**
      * @brief Parse JSON data returned from yr.no into struct
      */
-    yr::YrForecastStruct parseForecastJSON(std::string forecast);
+    static yr::YrForecastStruct parseForecastJSON(std::string forecast);
+
+    /**
+     * @brief Convert an ISO 8601 UTC time such as "2020-11-16T07:00:00Z"
+     * @return int64_t Seconds since the epoch
+     * @throws std::runtime_error If the time is malformed
+     */
+    static int64_t parseTimestamp(const std::string &timestamp);
+
+    /**
+     * @brief Parse every step of the JSON data returned from yr.no
+     * @throws std::exception If the data is not a forecast
+     */
+    static yr::YrForecastSeries parseForecastSeries(const std::string &forecast);
 
     /**
      * @brief Initialise the Curl object
@@ -82,15 +203,78 @@ namespace yr
     /**
      * @brief Send request to yr.no and store result
      * @param URL String containing the URL to send request to
-     * @return Forecast_data String containing forecast data in JSON format
+     * @return Forecast_data String containing forecast data in JSON format,
+     * or a message starting "Error, " if the request failed
      */
     std::string populateForecastData(std::string url, CURL *easyhandle, CURLcode code);
 
+    /**
+     * @brief Send request to yr.no, retrying and hedging per the fetch options
+     * @param url String containing the URL to send request to
+     * @param easyhandle Curl handle to send the request on
+     * @return FetchResult Forecast data, or why the request failed
+     */
+    yr::FetchResult fetchForecastData(const std::string &url, CURL *easyhandle);
+
+    /**
+     * @brief Set the timeout, retry and hedging settings for this object
+     */
+    void setFetchOptions(const yr::FetchOptions &options);
+
+    /**
+     * @brief Get the timeout, retry and hedging settings for this object
+     */
+    yr::FetchOptions getFetchOptions();
+
+    /**
+     * @brief Set the settings new YrForecast objects start with
+     */
+    static void setDefaultFetchOptions(const yr::FetchOptions &options);
+
+    /**
+     * @brief Get the settings new YrForecast objects start with
+     */
+    static yr::FetchOptions defaultFetchOptions();
+
     /**
      * @brief Get URL
      */
     std::string getURL();
 
+    /**
+     * @brief Set the product requested by the next URL created, compact by default
+     */
+    void setProduct(yr::ForecastProduct product);
+
+    /**
+     * @brief Get the product requested
+     */
+    yr::ForecastProduct getProduct();
+
+    /**
+     * @brief Send request to yr.no for this location, creating the URL if needed
+     * @return FetchResult Forecast data, or why the request failed
+     */
+    yr::FetchResult requestForecastData();
+
+    /**
+     * @brief Fetch and parse the forecast for this location
+     * 
+     * Concurrent callers asking for the same URL with the same fetch
+     * options share a single request to yr.no and a single parse of its
+     * response. Callers with different options, such as other timeouts or
+     * a replay archive, never share, so each waits only within its own
+     * timeout and retry budget.
+     * @return YrForecastStruct Parsed forecast
+     * @throws std::runtime_error If the request failed
+     */
+    yr::YrForecastStruct fetchForecast();
+
+    /**
+     * @brief Get the request coalescing counters for fetchForecast()
+     */
+    static yr::SingleFlightStats singleFlightStats();
+
     bool _curl_init = false; // True once curl handle created
 
     private:
@@ -99,9 +283,49 @@ namespace yr
      */
     void printForecast();
 
+    /**
+     * @brief Make one attempt, hedging it if enabled and it runs slow
+     */
+    yr::FetchResult performAttempt(const std::string &url, CURL *easyhandle);
+
+    /**
+     * @brief Run the attempt on the multi interface, sending a duplicate
+     * request on a second handle once hedge_after_ms has passed
+     */
+    yr::FetchResult performHedged(const std::string &url, CURL *easyhandle,
+                                  double hedge_after_ms);
+
+    /**
+     * @brief Set the options for one transfer on a curl handle
+     * @return bool False if curl rejected an option, error says which
+     */
+    bool setupTransfer(CURL *easyhandle, const std::string &url, std::string *body,
+                       std::string *headers, char *error_buffer, std::string &error);
+
+    /**
+     * @brief Unset the pointers setupTransfer() gave a curl handle
+     *
+     * They point at buffers of one transfer, and a handle the caller
+     * supplied may be used again after they are gone.
+     */
+    static void clearTransfer(CURL *easyhandle);
+
+    /**
+     * @brief Answer a request from the replay archive
+     */
+    yr::FetchResult replayRequest(const std::string &url);
+
+    /**
+     * @brief Add a finished transfer to the record archive
+     */
+    void recordTransfer(const std::string &url, const yr::FetchResult &result,
+                        const std::string &headers, const std::string &body,
+                        uint64_t offset_ms, double duration_ms);
+
     // URL data
     // Using YR.no API, LocationForecast 2.0
-    const std::string _base_url = "https://api.met.no/weatherapi/locationforecast/2.0/compact.json?";
+    const std::string _base_url = "https://api.met.no/weatherapi/locationforecast/2.0/";
+    ForecastProduct _product = ForecastProduct::Compact;
     // Location specific URL
     std::string _coords_url;
     // User Agent required by YR Terms of Service
@@ -110,7 +334,12 @@ namespace yr
     // CURL data
     CURLcode _code; // Curl status code
     CURL *_easyhandle = NULL; // Pointer to curl handle
+    char _error_buffer[CURL_ERROR_SIZE] = {}; // Buffer to store curl error strings
+    CURL *_hedge_handle = NULL; // Handle for hedged requests, created on first use
+    char _hedge_error_buffer[CURL_ERROR_SIZE] = {};
+    FetchOptions _fetch_options; // Timeout, retry and hedging settings
 
+    std::string _forecast_data; // Storage for data returned from yr.no
     YrForecastStruct _current_weather; // Structs to hold parsed data
 
     // Location data
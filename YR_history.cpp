@@ -0,0 +1,515 @@
+/**
+ * @file YR_history.cpp
+ * @brief Append-only store of successive forecast runs for each location
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "YR_history.h"
+#include "YR_endian.h"
+
+/** Location file layout, all integers little endian:
+ * block         u32 magic, i64 issue_time, u32 point_count, u32 payload_len,
+ *               payload
+ * payload       bit stream, most significant bit first, per point the time
+ *               then the seven values in YrForecastPoint order
+ * time          delta of delta from the previous point, the first point's
+ *               delta taken from the issue time
+ *               '0'                   same delta
+ *               '10'    7 bits        zigzag delta of delta
+ *               '110'   9 bits
+ *               '1110'  12 bits
+ *               '11110' 32 bits
+ *               '11111' 64 bits
+ * value         the value in tenths, as a delta from the field's previous
+ *               value in tenths
+ *               '0'                   same value
+ *               '10'    4 bits        zigzag delta
+ *               '110'   7 bits
+ *               '1110'  12 bits
+ *               '11110' 20 bits
+ *               '11111' then XOR with the field's previous value,
+ *                       '0' if equal, else '1', 5 bits leading zeros,
+ *                       5 bits length - 1, then the meaningful bits
+ */
+
+namespace yr
+{
+    static const uint32_t _block_magic = 0x42485259; // "YRHB"
+    static const size_t _block_header_size = 20;
+    static const int _value_count = 7;
+
+    static uint64_t zigzag(int64_t value)
+    {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    static int64_t unzigzag(uint64_t value)
+    {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+
+    static uint32_t floatBits(float value)
+    {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    static float bitsFloat(uint32_t bits)
+    {
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    static int leadingZeros(uint32_t value)
+    {
+        int count = 0;
+        for (uint32_t mask = 0x80000000u; mask != 0 && !(value & mask); mask >>= 1)
+        {
+            count++;
+        }
+        return count;
+    }
+
+    static int trailingZeros(uint32_t value)
+    {
+        int count = 0;
+        for (uint32_t mask = 1; mask != 0 && !(value & mask); mask <<= 1)
+        {
+            count++;
+        }
+        return count;
+    }
+
+    // Writes bits most significant first
+    class BitWriter
+    {
+    public:
+        void write(uint64_t value, int bits)
+        {
+            for (int i = bits - 1; i >= 0; i--)
+            {
+                _byte = static_cast<uint8_t>((_byte << 1) | ((value >> i) & 1));
+                if (++_used == 8)
+                {
+                    _out.push_back(static_cast<char>(_byte));
+                    _byte = 0;
+                    _used = 0;
+                }
+            }
+        }
+
+        std::string finish()
+        {
+            if (_used > 0)
+            {
+                _out.push_back(static_cast<char>(_byte << (8 - _used)));
+                _byte = 0;
+                _used = 0;
+            }
+            return _out;
+        }
+
+    private:
+        std::string _out;
+        uint8_t _byte = 0;
+        int _used = 0;
+    };
+
+    class BitReader
+    {
+    public:
+        explicit BitReader(const std::string &data)
+            : _data{data}
+        {
+        }
+
+        uint64_t read(int bits)
+        {
+            uint64_t value = 0;
+            for (int i = 0; i < bits; i++)
+            {
+                if (_position >= _data.size() * 8)
+                {
+                    _overrun = true;
+                    return 0;
+                }
+                unsigned char byte = static_cast<unsigned char>(_data[_position / 8]);
+                value = (value << 1) | ((byte >> (7 - _position % 8)) & 1);
+                _position++;
+            }
+            return value;
+        }
+
+        // Count of '1' bits before a '0', stopping at limit
+        int readPrefix(int limit)
+        {
+            int ones = 0;
+            while (ones < limit && read(1) == 1)
+            {
+                ones++;
+            }
+            return ones;
+        }
+
+        bool overrun() const
+        {
+            return _overrun;
+        }
+
+    private:
+        const std::string &_data;
+        size_t _position = 0;
+        bool _overrun = false;
+    };
+
+    // Payload bits after each prefix, the last prefix is the escape
+    static const int _time_widths[] = {0, 7, 9, 12, 32, 64};
+    static const int _value_widths[] = {0, 4, 7, 12, 20};
+
+    static void writeTime(BitWriter &writer, int64_t delta_of_delta)
+    {
+        if (delta_of_delta == 0)
+        {
+            writer.write(0, 1);
+            return;
+        }
+        uint64_t encoded = zigzag(delta_of_delta);
+        for (int prefix = 1; prefix < 5; prefix++)
+        {
+            if (encoded < (uint64_t(1) << _time_widths[prefix]))
+            {
+                // prefix ones then a zero
+                writer.write(((uint64_t(1) << prefix) - 1) << 1, prefix + 1);
+                writer.write(encoded, _time_widths[prefix]);
+                return;
+            }
+        }
+        writer.write(0x1f, 5);
+        writer.write(encoded, 64);
+    }
+
+    static int64_t readTime(BitReader &reader)
+    {
+        int prefix = reader.readPrefix(5);
+        if (prefix == 0)
+        {
+            return 0;
+        }
+        return unzigzag(reader.read(_time_widths[prefix]));
+    }
+
+    // Previous value of one field
+    struct FieldState
+    {
+        int64_t tenths = 0;
+        uint32_t bits = 0;
+    };
+
+    static void writeValue(BitWriter &writer, FieldState &state, float value)
+    {
+        uint32_t bits = floatBits(value);
+        // Only values that round trip through tenths bit for bit, so NaN,
+        // -0.0 and finer values take the XOR path
+        double scaled = static_cast<double>(value) * 10.0;
+        if (std::isfinite(value) && std::fabs(scaled) < 1e12)
+        {
+            int64_t tenths = std::llround(scaled);
+            if (floatBits(static_cast<float>(tenths / 10.0)) == bits)
+            {
+                uint64_t encoded = zigzag(tenths - state.tenths);
+                for (int prefix = 0; prefix < 5; prefix++)
+                {
+                    if (prefix == 0 ? encoded == 0 : encoded < (uint64_t(1) << _value_widths[prefix]))
+                    {
+                        writer.write(((uint64_t(1) << prefix) - 1) << 1, prefix + 1);
+                        writer.write(encoded, _value_widths[prefix]);
+                        state.tenths = tenths;
+                        state.bits = bits;
+                        return;
+                    }
+                }
+            }
+        }
+        writer.write(0x1f, 5);
+        uint32_t xored = bits ^ state.bits;
+        if (xored == 0)
+        {
+            writer.write(0, 1);
+        }
+        else
+        {
+            int leading = leadingZeros(xored);
+            int length = 32 - leading - trailingZeros(xored);
+            writer.write(1, 1);
+            writer.write(static_cast<uint64_t>(leading), 5);
+            writer.write(static_cast<uint64_t>(length - 1), 5);
+            writer.write(xored >> (32 - leading - length), length);
+        }
+        state.bits = bits;
+    }
+
+    static float readValue(BitReader &reader, FieldState &state)
+    {
+        int prefix = reader.readPrefix(5);
+        if (prefix < 5)
+        {
+            state.tenths += unzigzag(reader.read(_value_widths[prefix]));
+            float value = static_cast<float>(state.tenths / 10.0);
+            state.bits = floatBits(value);
+            return value;
+        }
+        if (reader.read(1) == 1)
+        {
+            int leading = static_cast<int>(reader.read(5));
+            int length = static_cast<int>(reader.read(5)) + 1;
+            if (leading + length > 32)
+            {
+                length = 32 - leading;
+            }
+            state.bits ^= static_cast<uint32_t>(reader.read(length)) << (32 - leading - length);
+        }
+        return bitsFloat(state.bits);
+    }
+
+    static void pointValues(YrForecastPoint &point, float *values[_value_count])
+    {
+        values[0] = &point.air_pressure_at_sea_level;
+        values[1] = &point.temperature;
+        values[2] = &point.cloud_area_fraction;
+        values[3] = &point.relative_humidity;
+        values[4] = &point.wind_direction;
+        values[5] = &point.wind_speed;
+        values[6] = &point.precipitation_amount;
+    }
+
+    std::string HistoryStore::encodeSeries(const YrForecastSeries &series)
+    {
+        BitWriter writer;
+        FieldState fields[_value_count];
+        int64_t previous_time = series.issue_time;
+        int64_t previous_delta = 0;
+        for (YrForecastPoint point : series.points) // Copy, pointValues() takes addresses
+        {
+            int64_t delta = point.time - previous_time;
+            writeTime(writer, delta - previous_delta);
+            previous_time = point.time;
+            previous_delta = delta;
+            float *values[_value_count];
+            pointValues(point, values);
+            for (int i = 0; i < _value_count; i++)
+            {
+                writeValue(writer, fields[i], *values[i]);
+            }
+        }
+        return writer.finish();
+    }
+
+    bool HistoryStore::decodeSeries(const std::string &payload, uint32_t point_count,
+                                    YrForecastSeries &series)
+    {
+        BitReader reader(payload);
+        FieldState fields[_value_count];
+        int64_t previous_time = series.issue_time;
+        int64_t previous_delta = 0;
+        series.points.clear();
+        // point_count comes from the file, don't let it size the allocation
+        series.points.reserve(std::min<size_t>(point_count, payload.size()));
+        for (uint32_t p = 0; p < point_count; p++)
+        {
+            YrForecastPoint point;
+            previous_delta += readTime(reader);
+            previous_time += previous_delta;
+            point.time = previous_time;
+            float *values[_value_count];
+            pointValues(point, values);
+            for (int i = 0; i < _value_count; i++)
+            {
+                *values[i] = readValue(reader, fields[i]);
+            }
+            if (reader.overrun())
+            {
+                return false;
+            }
+            series.points.push_back(point);
+        }
+        return true;
+    }
+
+    HistoryStore::HistoryStore(const std::string &directory)
+        : _directory{directory}
+    {
+        if (::mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            std::cout << "Failed to create history directory: " << directory << std::endl;
+            return;
+        }
+        _open = true;
+    }
+
+    bool HistoryStore::isOpen() const
+    {
+        return _open;
+    }
+
+    std::string HistoryStore::path(const ForecastLocation &location) const
+    {
+        // Same precision as the request URL, yr.no ignores anything finer
+        char name[64];
+        snprintf(name, sizeof(name), "%.4f_%.4f_%d.yrh",
+                 location.latitude, location.longitude, location.altitude);
+        return _directory + "/" + name;
+    }
+
+    bool HistoryStore::repairTail(const std::string &file)
+    {
+        // A block cut short by a crash would hide every block appended after it
+        std::ifstream in(file, std::ios::binary);
+        if (!in)
+        {
+            return true;
+        }
+        in.seekg(0, std::ios::end);
+        uint64_t file_size = static_cast<uint64_t>(in.tellg());
+        uint64_t position = 0;
+        char header[_block_header_size];
+        while (position + _block_header_size <= file_size)
+        {
+            in.seekg(position);
+            if (!in.read(header, sizeof(header)) || getU32(header) != _block_magic)
+            {
+                break;
+            }
+            uint64_t block_size = _block_header_size + getU32(header + 16);
+            if (position + block_size > file_size)
+            {
+                break;
+            }
+            position += block_size;
+        }
+        if (position == file_size)
+        {
+            return true;
+        }
+        std::cout << "Dropping incomplete block at the end of " << file << std::endl;
+        return ::truncate(file.c_str(), static_cast<off_t>(position)) == 0;
+    }
+
+    bool HistoryStore::append(const ForecastLocation &location, const YrForecastSeries &series)
+    {
+        if (!_open)
+        {
+            return false;
+        }
+        // Encode before taking the lock, it is shared by every location and
+        // only needs to cover the tail check and the write
+        std::string payload = encodeSeries(series);
+        std::string block;
+        block.reserve(_block_header_size + payload.size());
+        putU32(block, _block_magic);
+        putU64(block, static_cast<uint64_t>(series.issue_time));
+        putU32(block, static_cast<uint32_t>(series.points.size()));
+        putU32(block, static_cast<uint32_t>(payload.size()));
+        block += payload;
+
+        std::string file = path(location);
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_checked.find(file) == _checked.end())
+        {
+            if (!repairTail(file))
+            {
+                return false;
+            }
+            _checked.insert(file);
+        }
+        struct stat before;
+        off_t size = ::stat(file.c_str(), &before) == 0 ? before.st_size : 0;
+        std::ofstream out(file, std::ios::binary | std::ios::app);
+        out.write(block.data(), block.size());
+        out.flush();
+        if (out)
+        {
+            return true;
+        }
+        // Don't leave part of a block for the next append to land behind,
+        // if it can't be cut off now check the tail again next time
+        out.close();
+        if (::truncate(file.c_str(), size) != 0)
+        {
+            _checked.erase(file);
+        }
+        return false;
+    }
+
+    size_t HistoryStore::scan(const ForecastLocation &location, int64_t from_issue,
+                              int64_t to_issue, const Callback &callback) const
+    {
+        std::ifstream in(path(location), std::ios::binary);
+        if (!in)
+        {
+            return 0;
+        }
+        in.seekg(0, std::ios::end);
+        uint64_t file_size = static_cast<uint64_t>(in.tellg());
+        in.seekg(0);
+        size_t found = 0;
+        char header[_block_header_size];
+        std::string payload;
+        YrForecastSeries series;
+        while (in.read(header, sizeof(header)) && getU32(header) == _block_magic)
+        {
+            int64_t issue_time = static_cast<int64_t>(getU64(header + 4));
+            uint32_t point_count = getU32(header + 12);
+            uint32_t payload_size = getU32(header + 16);
+            // A block still being written or a corrupt header ends the scan,
+            // before its sizes are trusted with an allocation. Every point
+            // takes at least a byte
+            uint64_t position = static_cast<uint64_t>(in.tellg());
+            if (payload_size > file_size - position || point_count > payload_size)
+            {
+                break;
+            }
+            if (issue_time < from_issue || issue_time > to_issue)
+            {
+                in.seekg(payload_size, std::ios::cur);
+                continue;
+            }
+            payload.resize(payload_size);
+            if (payload_size > 0 && !in.read(&payload[0], payload_size))
+            {
+                break;
+            }
+            series.issue_time = issue_time;
+            if (!decodeSeries(payload, point_count, series))
+            {
+                break;
+            }
+            callback(series);
+            found++;
+        }
+        return found;
+    }
+
+    std::vector<YrForecastSeries> HistoryStore::read(const ForecastLocation &location,
+                                                     int64_t from_issue, int64_t to_issue) const
+    {
+        std::vector<YrForecastSeries> runs;
+        scan(location, from_issue, to_issue, [&runs](const YrForecastSeries &series)
+        {
+            runs.push_back(series);
+        });
+        return runs;
+    }
+
+} // namespace yr
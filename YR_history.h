@@ -0,0 +1,109 @@
+/**
+ * @file YR_history.h
+ * @brief Append-only store of successive forecast runs for each location
+ *
+ * Each location has its own file, and every run appended to it becomes a
+ * compressed block tagged with the run's issue time. Only the fields of
+ * YrForecastPoint are kept, the rest of the response is not stored. Timestamps are stored
+ * as deltas of deltas. Values are stored as deltas of their tenths, since
+ * yr.no reports to one decimal place, falling back to an XOR with the
+ * previous value when a value is not a whole number of tenths. This is the
+ * scheme from Facebook's Gorilla paper.
+ */
+
+#ifndef YR_HISTORY_H
+#define YR_HISTORY_H
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "YR_forecast.h"
+
+
+namespace yr
+{
+    /**
+     * @brief Class to append forecast runs to disk and scan them back by issue time
+     */
+    class HistoryStore
+    {
+
+    public:
+    /**
+     * @brief Function receiving each run found by a scan
+     */
+        typedef std::function<void(const YrForecastSeries &series)> Callback;
+
+    /**
+     * @brief Construct a new HistoryStore object
+     * @param directory Directory holding the location files, created if missing
+     */
+        explicit HistoryStore(const std::string &directory);
+
+        HistoryStore(const HistoryStore &) = delete;
+        HistoryStore &operator=(const HistoryStore &) = delete;
+
+    /**
+     * @brief True if the directory exists or could be created
+     */
+        bool isOpen() const;
+
+    /**
+     * @brief Append a run for a location, safe to call from several threads
+     * @return bool False if the write failed
+     */
+        bool append(const ForecastLocation &location, const YrForecastSeries &series);
+
+    /**
+     * @brief Hand every run of a location issued within a time range to callback
+     *
+     * Runs come back in the order they were appended. Blocks outside the
+     * range are skipped without being read.
+     * @param from_issue Earliest issue time, inclusive
+     * @param to_issue Latest issue time, inclusive
+     * @return size_t Number of runs handed to callback
+     */
+        size_t scan(const ForecastLocation &location, int64_t from_issue, int64_t to_issue,
+                    const Callback &callback) const;
+
+    /**
+     * @brief Collect every run of a location issued within a time range
+     */
+        std::vector<YrForecastSeries> read(const ForecastLocation &location,
+                                           int64_t from_issue, int64_t to_issue) const;
+
+    /**
+     * @brief File holding the runs of a location
+     */
+        std::string path(const ForecastLocation &location) const;
+
+    /**
+     * @brief Compress the points of a series into a block payload
+     */
+        static std::string encodeSeries(const YrForecastSeries &series);
+
+    /**
+     * @brief Decompress a block payload written by encodeSeries()
+     *
+     * series.issue_time must already hold the block's issue time.
+     * @return bool False if the payload is shorter than point_count points
+     */
+        static bool decodeSeries(const std::string &payload, uint32_t point_count,
+                                 YrForecastSeries &series);
+
+    private:
+        bool repairTail(const std::string &file);
+
+        std::string _directory;
+        bool _open = false;
+        std::mutex _mutex;
+        std::set<std::string> _checked; // Files whose tail has been checked this run
+    };
+
+} // namespace yr
+
+#endif //YR_HISTORY_H
@@ -0,0 +1,288 @@
+/**
+ * @file YR_pipeline.cpp
+ * @brief Staged fetch, parse and publish pipeline for batches of locations
+ */
+
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <stdexcept>
+
+#include "YR_pipeline.h"
+
+
+namespace yr
+{
+    WorkStealingPool::WorkStealingPool(int workers, size_t queue_capacity)
+    {
+        if (workers <= 0)
+        {
+            workers = static_cast<int>(std::thread::hardware_concurrency());
+            workers = workers > 0 ? workers : 1;
+        }
+        for (int i = 0; i < workers; i++)
+        {
+            _queues.push_back(std::unique_ptr<BoundedQueue<Task>>(
+                new BoundedQueue<Task>(queue_capacity)));
+        }
+        for (int i = 0; i < workers; i++)
+        {
+            _threads.push_back(std::thread(&WorkStealingPool::runWorker, this, i));
+        }
+    }
+
+    WorkStealingPool::~WorkStealingPool()
+    {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(_idle_mutex);
+            _stop = true;
+        }
+        _idle_cv.notify_all();
+        for (auto &thread : _threads)
+        {
+            thread.join();
+        }
+    }
+
+    bool WorkStealingPool::trySubmit(Task &task)
+    {
+        // Count the task before it's visible, so neither wait() nor a
+        // worker popping it straight away sees the counts go below zero
+        _pending++;
+        _queued++;
+        size_t start = _next_queue++;
+        for (size_t i = 0; i < _queues.size(); i++)
+        {
+            if (_queues[(start + i) % _queues.size()]->tryPush(task))
+            {
+                // Only pay for the lock when a worker may be asleep
+                if (_sleeping > 0)
+                {
+                    std::lock_guard<std::mutex> lock(_idle_mutex);
+                    _idle_cv.notify_one();
+                }
+                return true;
+            }
+        }
+        _queued--;
+        _pending--;
+        return false;
+    }
+
+    void WorkStealingPool::submit(Task task)
+    {
+        if (trySubmit(task))
+        {
+            return;
+        }
+        _blocked_submits++;
+        // Spin briefly, then back off until a worker frees a slot
+        int attempts = 0;
+        while (!trySubmit(task))
+        {
+            if (++attempts < 64)
+            {
+                std::this_thread::yield();
+            }
+            else
+            {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+    }
+
+    void WorkStealingPool::wait()
+    {
+        std::unique_lock<std::mutex> lock(_done_mutex);
+        _done_cv.wait(lock, [this]() { return _pending == 0; });
+    }
+
+    int WorkStealingPool::size() const
+    {
+        return static_cast<int>(_threads.size());
+    }
+
+    uint64_t WorkStealingPool::stolen() const
+    {
+        return _stolen;
+    }
+
+    uint64_t WorkStealingPool::blockedSubmits() const
+    {
+        return _blocked_submits;
+    }
+
+    bool WorkStealingPool::takeTask(size_t index, Task &task)
+    {
+        // Own queue first, then steal from the others in turn
+        for (size_t i = 0; i < _queues.size(); i++)
+        {
+            if (_queues[(index + i) % _queues.size()]->tryPop(task))
+            {
+                _queued--;
+                if (i != 0)
+                {
+                    _stolen++;
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void WorkStealingPool::runWorker(size_t index)
+    {
+        Task task;
+        while (true)
+        {
+            if (takeTask(index, task))
+            {
+                try
+                {
+                    task();
+                }
+                catch (...)
+                {
+                    // Tasks report their own failures, keep the worker alive
+                }
+                task = Task();
+                if (--_pending == 0)
+                {
+                    std::lock_guard<std::mutex> lock(_done_mutex);
+                    _done_cv.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(_idle_mutex);
+            _sleeping++;
+            _idle_cv.wait(lock, [this]() { return _stop || _queued > 0; });
+            _sleeping--;
+            if (_stop && _queued == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    ForecastPipeline::ForecastPipeline(const PipelineConfig &config, Fetcher fetcher)
+        : _config{config}
+        , _fetcher{fetcher}
+        , _pool{config.parse_workers, config.queue_capacity}
+    {
+        if (!_fetcher)
+        {
+            _fetcher = [](const ForecastLocation &location)
+            {
+                YrForecast forecast(location.latitude, location.longitude, location.altitude);
+                FetchResult result = forecast.requestForecastData();
+                forecast.curlCleanUp();
+                if (!result.ok())
+                {
+                    throw std::runtime_error(result.error);
+                }
+                return result.body;
+            };
+        }
+    }
+
+    void ForecastPipeline::run(const std::vector<ForecastLocation> &locations, const Sink &sink)
+    {
+        std::atomic<size_t> next{0};
+        auto io_stage = [&]()
+        {
+            while (true)
+            {
+                size_t index = next++;
+                if (index >= locations.size())
+                {
+                    return;
+                }
+                const ForecastLocation &location = locations[index];
+                std::string body;
+                std::string error;
+                try
+                {
+                    body = _fetcher(location);
+                    _fetched++;
+                }
+                catch (const std::exception &e)
+                {
+                    error = std::string("fetch failed: ") + e.what();
+                }
+                catch (...)
+                {
+                    error = "fetch failed: unknown error";
+                }
+                if (!error.empty())
+                {
+                    // Nothing to parse, publish the failure straight away
+                    _failed++;
+                    PipelineResult result = {index, location, false, YrForecastStruct(), error};
+                    try
+                    {
+                        sink(result);
+                    }
+                    catch (...)
+                    {
+                        // Sink failures are the caller's to report, keep the I/O thread alive
+                    }
+                    continue;
+                }
+                // Parse stage, blocks here while the parse queues are full
+                _pool.submit(std::bind([this, &sink, &location, index](std::string &data)
+                {
+                    PipelineResult result = {index, location, false, YrForecastStruct(), ""};
+                    try
+                    {
+                        result.forecast = YrForecast::parseForecastJSON(data);
+                        result.success = true;
+                        _parsed++;
+                    }
+                    catch (const std::exception &e)
+                    {
+                        result.error = std::string("parse failed: ") + e.what();
+                        _failed++;
+                    }
+                    // Publish stage
+                    sink(result);
+                }, std::move(body)));
+            }
+        };
+
+        int io_count = _config.io_threads > 0 ? _config.io_threads : 1;
+        std::vector<std::thread> io_threads;
+        for (int i = 0; i < io_count; i++)
+        {
+            io_threads.push_back(std::thread(io_stage));
+        }
+        for (auto &thread : io_threads)
+        {
+            thread.join();
+        }
+        _pool.wait();
+    }
+
+    std::vector<PipelineResult> ForecastPipeline::run(const std::vector<ForecastLocation> &locations)
+    {
+        std::vector<PipelineResult> results(locations.size());
+        // Every index is written by exactly one stage, no lock needed
+        run(locations, [&results](const PipelineResult &result)
+        {
+            results[result.index] = result;
+        });
+        return results;
+    }
+
+    PipelineStats ForecastPipeline::stats() const
+    {
+        PipelineStats stats;
+        stats.fetched = _fetched;
+        stats.parsed = _parsed;
+        stats.failed = _failed;
+        stats.stolen = _pool.stolen();
+        stats.backpressure_waits = _pool.blockedSubmits();
+        return stats;
+    }
+
+} // namespace yr
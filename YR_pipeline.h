@@ -0,0 +1,204 @@
+/**
+ * @file YR_pipeline.h
+ * @brief Staged fetch, parse and publish pipeline for batches of locations
+ *
+ * I/O threads fetch forecasts and hand the response bodies over bounded
+ * lock-free queues to a work-stealing pool of parse workers, which publish
+ * each parsed forecast. Network waits and parsing overlap, and when the
+ * parse workers fall behind the full queues hold the I/O threads back.
+ */
+
+#ifndef YR_PIPELINE_H
+#define YR_PIPELINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "YR_forecast.h"
+#include "YR_queue.h"
+
+
+namespace yr
+{
+    /**
+     * @brief Thread pool where idle workers steal queued tasks from busy ones
+     *
+     * Every worker owns a bounded queue. Tasks are spread over the queues
+     * round-robin, a worker runs tasks from its own queue first and steals
+     * from the others when it runs dry.
+     */
+    class WorkStealingPool
+    {
+
+    public:
+        typedef std::function<void()> Task;
+
+    /**
+     * @brief Construct a new WorkStealingPool object
+     * @param workers Number of worker threads, 0 for one per core
+     * @param queue_capacity Tasks each worker queue holds before submit blocks
+     */
+        WorkStealingPool(int workers, size_t queue_capacity);
+
+    /**
+     * @brief Destructor, runs the remaining tasks then stops the workers
+     */
+        ~WorkStealingPool();
+
+        WorkStealingPool(const WorkStealingPool &) = delete;
+        WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    /**
+     * @brief Queue a task without blocking
+     * @return bool False if every worker queue is full
+     */
+        bool trySubmit(Task &task);
+
+    /**
+     * @brief Queue a task, waiting while every worker queue is full
+     */
+        void submit(Task task);
+
+    /**
+     * @brief Block until every submitted task has run
+     */
+        void wait();
+
+    /**
+     * @brief Number of worker threads
+     */
+        int size() const;
+
+    /**
+     * @brief Number of tasks run by a worker other than the one queued to
+     */
+        uint64_t stolen() const;
+
+    /**
+     * @brief Number of submit() calls that had to wait for queue space
+     */
+        uint64_t blockedSubmits() const;
+
+    private:
+        void runWorker(size_t index);
+        bool takeTask(size_t index, Task &task);
+
+        std::vector<std::unique_ptr<BoundedQueue<Task>>> _queues;
+        std::vector<std::thread> _threads;
+        std::atomic<size_t> _next_queue{0};
+        std::atomic<size_t> _queued{0}; // Tasks sitting in the queues
+        std::atomic<size_t> _pending{0}; // Tasks submitted but not yet finished
+        std::atomic<bool> _stop{false};
+
+        // Idle workers sleep here
+        std::mutex _idle_mutex;
+        std::condition_variable _idle_cv;
+        std::atomic<int> _sleeping{0};
+        // wait() sleeps here
+        std::mutex _done_mutex;
+        std::condition_variable _done_cv;
+
+        // Counters
+        std::atomic<uint64_t> _stolen{0};
+        std::atomic<uint64_t> _blocked_submits{0};
+    };
+
+    /**
+     * @brief Outcome of one location in a pipeline batch
+     */
+    struct PipelineResult
+    {
+        size_t index; // Position of the location in the batch
+        ForecastLocation location;
+        bool success;
+        YrForecastStruct forecast; // Valid when success
+        std::string error; // Reason when not success
+    };
+
+    /**
+     * @brief Settings for the pipeline stages
+     */
+    struct PipelineConfig
+    {
+        int io_threads = 8; // Fetches in progress at once
+        int parse_workers = 0; // Parse threads, 0 for one per core
+        size_t queue_capacity = 16; // Bodies queued per parse worker, the backpressure limit
+    };
+
+    /**
+     * @brief Snapshot of the pipeline counters, totals over every run
+     */
+    struct PipelineStats
+    {
+        uint64_t fetched;
+        uint64_t parsed;
+        uint64_t failed;
+        uint64_t stolen; // Parses run by a worker other than the one queued to
+        uint64_t backpressure_waits; // Hand-overs that waited for queue space
+    };
+
+    /**
+     * @brief Fetch, parse and publish forecasts for a batch of locations
+     */
+    class ForecastPipeline
+    {
+
+    public:
+    /**
+     * @brief Function returning the raw forecast body for a location
+     *
+     * Called from the I/O threads, may throw anything to report a failure.
+     */
+        typedef std::function<std::string(const ForecastLocation &location)> Fetcher;
+
+    /**
+     * @brief Function receiving each result, called from the parse workers
+     * and I/O threads so it must be thread safe. Anything it throws is dropped.
+     */
+        typedef std::function<void(const PipelineResult &result)> Sink;
+
+    /**
+     * @brief Construct a new ForecastPipeline object
+     * @param config Stage settings
+     * @param fetcher Fetch function, defaults to YrForecast::requestForecastData()
+     */
+        explicit ForecastPipeline(const PipelineConfig &config,
+                                  Fetcher fetcher = Fetcher());
+
+    /**
+     * @brief Run a batch, publishing each result to sink as it completes
+     */
+        void run(const std::vector<ForecastLocation> &locations, const Sink &sink);
+
+    /**
+     * @brief Run a batch and collect the results
+     * @return std::vector<PipelineResult> Results in the order of locations
+     */
+        std::vector<PipelineResult> run(const std::vector<ForecastLocation> &locations);
+
+    /**
+     * @brief Get the current counters
+     */
+        PipelineStats stats() const;
+
+    private:
+        PipelineConfig _config;
+        Fetcher _fetcher;
+        WorkStealingPool _pool;
+
+        // Counters
+        std::atomic<uint64_t> _fetched{0};
+        std::atomic<uint64_t> _parsed{0};
+        std::atomic<uint64_t> _failed{0};
+    };
+
+} // namespace yr
+
+#endif //YR_PIPELINE_H
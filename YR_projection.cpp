@@ -0,0 +1,301 @@
+/**
+ * @file YR_projection.cpp
+ * @brief Extract only the requested fields from a forecast response
+ */
+
+#include <limits>
+#include <stdexcept>
+
+#include <nlohmann/json.hpp>
+
+#include "YR_forecast.h"
+#include "YR_projection.h"
+
+using json = nlohmann::json;
+
+namespace yr
+{
+    size_t ProjectedForecast::steps() const
+    {
+        return times.size();
+    }
+
+    float ProjectedForecast::value(size_t step, size_t field) const
+    {
+        return values[step * fields.size() + field];
+    }
+
+    const std::vector<std::string> &ForecastProjection::periods()
+    {
+        static const std::vector<std::string> names =
+            {"instant", "next_1_hours", "next_6_hours", "next_12_hours"};
+        return names;
+    }
+
+    ForecastProjection::ForecastProjection(const std::vector<std::string> &fields,
+                                           size_t max_steps)
+        : _fields{fields}
+        , _columns(periods().size())
+        , _max_steps{max_steps}
+    {
+        for (size_t i = 0; i < fields.size(); i++)
+        {
+            size_t dot = fields[i].find('.');
+            std::string period = dot == std::string::npos ? "instant" : fields[i].substr(0, dot);
+            std::string name = dot == std::string::npos ? fields[i] : fields[i].substr(dot + 1);
+            size_t p = 0;
+            while (p < periods().size() && periods()[p] != period)
+            {
+                p++;
+            }
+            if (p == periods().size() || name.empty())
+            {
+                throw std::invalid_argument("unknown forecast field " + fields[i]);
+            }
+            _columns[p].push_back(std::make_pair(name, i));
+        }
+    }
+
+    /**
+     * @brief SAX handler following the path to each requested field
+     *
+     * Only the containers on the way to a requested field are tracked,
+     * everything under any other key is counted in and out and its keys
+     * and values dropped as they arrive.
+     */
+    class ProjectionHandler
+    {
+    public:
+        // Context of each open container, periods and their details offset by index
+        enum Context
+        {
+            Skip, Root, Properties, Meta, Timeseries, Step, Data,
+            Period = 8, Details = 16
+        };
+
+        typedef std::vector<std::vector<std::pair<std::string, size_t>>> Columns;
+
+        ProjectionHandler(const Columns &columns, size_t max_steps, ProjectedForecast &result)
+            : _columns(columns)
+            , _max_steps{max_steps}
+            , _result(result)
+        {
+            _stack.reserve(16);
+        }
+
+        bool null()
+        {
+            return clearKey();
+        }
+
+        bool boolean(bool)
+        {
+            return clearKey();
+        }
+
+        bool number_integer(json::number_integer_t value)
+        {
+            return number(static_cast<float>(value));
+        }
+
+        bool number_unsigned(json::number_unsigned_t value)
+        {
+            return number(static_cast<float>(value));
+        }
+
+        bool number_float(json::number_float_t value, const json::string_t &)
+        {
+            return number(static_cast<float>(value));
+        }
+
+        bool string(json::string_t &value)
+        {
+            if (_scalar == Time)
+            {
+                _result.times.back() = YrForecast::parseTimestamp(value);
+            }
+            else if (_scalar == IssueTime)
+            {
+                _result.issue_time = YrForecast::parseTimestamp(value);
+            }
+            return clearKey();
+        }
+
+#if NLOHMANN_JSON_VERSION_MAJOR > 3 || (NLOHMANN_JSON_VERSION_MAJOR == 3 && NLOHMANN_JSON_VERSION_MINOR >= 8)
+        bool binary(json::binary_t &)
+        {
+            return clearKey();
+        }
+#endif
+
+        bool start_object(std::size_t)
+        {
+            int context = _next;
+            if (_stack.empty())
+            {
+                context = Root;
+            }
+            else if (_stack.back() == Timeseries)
+            {
+                context = Step;
+                _result.times.push_back(0);
+                _result.values.resize(_result.values.size() + _result.fields.size(),
+                                      std::numeric_limits<float>::quiet_NaN());
+            }
+            _stack.push_back(context);
+            clearKey();
+            return true;
+        }
+
+        bool end_object()
+        {
+            int context = _stack.back();
+            _stack.pop_back();
+            clearKey();
+            if (context == Step && _max_steps > 0 && _result.times.size() >= _max_steps)
+            {
+                // Have every step wanted, stop reading
+                _stopped = true;
+                return false;
+            }
+            return true;
+        }
+
+        bool start_array(std::size_t)
+        {
+            _stack.push_back(_next == Timeseries ? Timeseries : Skip);
+            clearKey();
+            return true;
+        }
+
+        bool end_array()
+        {
+            _stack.pop_back();
+            return clearKey();
+        }
+
+        bool key(json::string_t &name)
+        {
+            clearKey();
+            int context = _stack.back();
+            switch (context)
+            {
+            case Skip:
+                break;
+            case Root:
+                _next = name == "properties" ? Properties : Skip;
+                break;
+            case Properties:
+                _next = name == "meta" ? Meta : name == "timeseries" ? Timeseries : Skip;
+                break;
+            case Meta:
+                _scalar = name == "updated_at" ? IssueTime : None;
+                break;
+            case Step:
+                _next = name == "data" ? Data : Skip;
+                _scalar = name == "time" ? Time : None;
+                break;
+            case Data:
+                for (size_t p = 0; p < _columns.size(); p++)
+                {
+                    if (!_columns[p].empty() && name == ForecastProjection::periods()[p])
+                    {
+                        _next = Period + static_cast<int>(p);
+                    }
+                }
+                break;
+            default:
+                if (context >= Details)
+                {
+                    _period = context - Details;
+                    for (const auto &column : _columns[_period])
+                    {
+                        if (column.first == name)
+                        {
+                            _name = &column.first;
+                            break;
+                        }
+                    }
+                }
+                else if (context >= Period && name == "details")
+                {
+                    _next = Details + (context - Period);
+                }
+                break;
+            }
+            return true;
+        }
+
+        bool parse_error(std::size_t, const std::string &, const json::exception &e)
+        {
+            _error = e.what();
+            return false;
+        }
+
+        bool stopped() const
+        {
+            return _stopped;
+        }
+
+        const std::string &error() const
+        {
+            return _error;
+        }
+
+    private:
+        enum Scalar
+        {
+            None, Time, IssueTime
+        };
+
+        bool clearKey()
+        {
+            _next = Skip;
+            _scalar = None;
+            _name = nullptr;
+            return true;
+        }
+
+        bool number(float value)
+        {
+            if (_name)
+            {
+                float *row = &_result.values[_result.values.size() - _result.fields.size()];
+                // The same field may fill several columns
+                for (const auto &column : _columns[_period])
+                {
+                    if (column.first == *_name)
+                    {
+                        row[column.second] = value;
+                    }
+                }
+            }
+            return clearKey();
+        }
+
+        const Columns &_columns;
+        size_t _max_steps;
+        ProjectedForecast &_result;
+        std::vector<int> _stack;
+        int _next = Skip; // Context of a container opened after the last key
+        Scalar _scalar = None; // Meaning of a string value after the last key
+        // Period and field name of a number after the last key, if requested
+        int _period = 0;
+        const std::string *_name = nullptr;
+        bool _stopped = false;
+        std::string _error;
+    };
+
+    ProjectedForecast ForecastProjection::parse(const std::string &forecast) const
+    {
+        ProjectedForecast result;
+        result.fields = _fields;
+        ProjectionHandler handler(_columns, _max_steps, result);
+        if (!json::sax_parse(forecast, &handler) && !handler.stopped())
+        {
+            throw std::runtime_error("forecast data parse failed: " + handler.error());
+        }
+        return result;
+    }
+
+} // namespace yr
@@ -0,0 +1,88 @@
+/**
+ * @file YR_projection.h
+ * @brief Extract only the requested fields from a forecast response
+ *
+ * The response is read as a stream of tokens rather than parsed into a
+ * document, so fields nobody asked for are stepped over without being
+ * stored. Useful with the complete product, whose responses are several
+ * times larger than compact ones.
+ */
+
+#ifndef YR_PROJECTION_H
+#define YR_PROJECTION_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+namespace yr
+{
+    /**
+     * @brief Structure containing the requested fields of every step of a forecast
+     */
+    struct ProjectedForecast
+    {
+        int64_t issue_time = 0; // When yr.no updated the forecast, seconds since the epoch
+        std::vector<std::string> fields; // As requested
+        std::vector<int64_t> times; // Start of each step, seconds since the epoch
+        // One row of fields.size() values per step, NaN where a step lacks a field
+        std::vector<float> values;
+
+    /**
+     * @brief Number of steps read
+     */
+        size_t steps() const;
+
+    /**
+     * @brief Value of a field at a step
+     * @param step Index into times
+     * @param field Index into fields
+     */
+        float value(size_t step, size_t field) const;
+    };
+
+    /**
+     * @brief Class to extract a declared set of fields from forecast responses
+     *
+     * Fields are named as in the response, prefixed with the period they
+     * belong to, for example "next_1_hours.precipitation_amount" or
+     * "next_6_hours.air_temperature_max". Names without a period are read
+     * from the instant details, so "dew_point_temperature" is
+     * "instant.dew_point_temperature". Only numeric fields are supported.
+     */
+    class ForecastProjection
+    {
+
+    public:
+    /**
+     * @brief Construct a new ForecastProjection object
+     * @param fields Fields to extract, in the column order of the result
+     * @param max_steps Stop reading after this many steps, 0 for every step
+     * @throws std::invalid_argument If a field names an unknown period
+     */
+        explicit ForecastProjection(const std::vector<std::string> &fields, size_t max_steps = 0);
+
+    /**
+     * @brief Extract the fields from a response, safe to call from several threads
+     * @throws std::runtime_error If the response is not valid JSON
+     */
+        ProjectedForecast parse(const std::string &forecast) const;
+
+    /**
+     * @brief Periods a field can be prefixed with
+     */
+        static const std::vector<std::string> &periods();
+
+    private:
+        std::vector<std::string> _fields;
+        // Requested fields of each period in periods() order, as the name
+        // without the period and the column in the result
+        std::vector<std::vector<std::pair<std::string, size_t>>> _columns;
+        size_t _max_steps;
+    };
+
+} // namespace yr
+
+#endif //YR_PROJECTION_H
@@ -0,0 +1,153 @@
+/**
+ * @file YR_queue.h
+ * @brief Bounded lock-free queue for handing work between threads
+ */
+
+#ifndef YR_QUEUE_H
+#define YR_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+
+namespace yr
+{
+    /**
+     * @brief Template class for a bounded multi-producer multi-consumer queue
+     *
+     * Each slot carries a sequence number telling producers and consumers
+     * whose turn it is, so pushes and pops only need a compare-and-swap on
+     * the head or tail position and never take a lock. Capacity is rounded
+     * up to a power of two.
+     */
+    template <typename T>
+    class BoundedQueue
+    {
+
+    public:
+    /**
+     * @brief Construct a new BoundedQueue object
+     * @param capacity Minimum number of items the queue can hold
+     */
+        explicit BoundedQueue(size_t capacity)
+        {
+            size_t size = 2;
+            while (size < capacity)
+            {
+                size <<= 1;
+            }
+            _mask = size - 1;
+            _slots.reset(new Slot[size]);
+            for (size_t i = 0; i < size; i++)
+            {
+                _slots[i].sequence.store(i, std::memory_order_relaxed);
+            }
+        }
+
+        BoundedQueue(const BoundedQueue &) = delete;
+        BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    /**
+     * @brief Add an item, moving from it only on success
+     * @return bool False if the queue is full
+     */
+        bool tryPush(T &item)
+        {
+            size_t position = _tail.load(std::memory_order_relaxed);
+            Slot *slot;
+            while (true)
+            {
+                slot = &_slots[position & _mask];
+                size_t sequence = slot->sequence.load(std::memory_order_acquire);
+                intptr_t difference = static_cast<intptr_t>(sequence) -
+                    static_cast<intptr_t>(position);
+                if (difference == 0)
+                {
+                    if (_tail.compare_exchange_weak(position, position + 1,
+                                                    std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (difference < 0)
+                {
+                    // Slot still holds an item from the previous lap
+                    return false;
+                }
+                else
+                {
+                    position = _tail.load(std::memory_order_relaxed);
+                }
+            }
+            slot->item = std::move(item);
+            slot->sequence.store(position + 1, std::memory_order_release);
+            return true;
+        }
+
+    /**
+     * @brief Remove the oldest item
+     * @return bool False if the queue is empty
+     */
+        bool tryPop(T &item)
+        {
+            size_t position = _head.load(std::memory_order_relaxed);
+            Slot *slot;
+            while (true)
+            {
+                slot = &_slots[position & _mask];
+                size_t sequence = slot->sequence.load(std::memory_order_acquire);
+                intptr_t difference = static_cast<intptr_t>(sequence) -
+                    static_cast<intptr_t>(position + 1);
+                if (difference == 0)
+                {
+                    if (_head.compare_exchange_weak(position, position + 1,
+                                                    std::memory_order_relaxed))
+                    {
+                        break;
+                    }
+                }
+                else if (difference < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    position = _head.load(std::memory_order_relaxed);
+                }
+            }
+            item = std::move(slot->item);
+            slot->item = T();
+            slot->sequence.store(position + _mask + 1, std::memory_order_release);
+            return true;
+        }
+
+    /**
+     * @brief Number of items the queue can hold
+     */
+        size_t capacity() const
+        {
+            return _mask + 1;
+        }
+
+    private:
+        struct Slot
+        {
+            std::atomic<size_t> sequence;
+            T item;
+        };
+
+        std::unique_ptr<Slot[]> _slots;
+        size_t _mask = 0;
+        // Padded onto separate cache lines so producers and consumers don't contend
+        char _pad_tail[64];
+        std::atomic<size_t> _tail{0};
+        char _pad_head[64];
+        std::atomic<size_t> _head{0};
+    };
+
+} // namespace yr
+
+#endif //YR_QUEUE_H
@@ -0,0 +1,952 @@
+/**
+ * @file YR_server.cpp
+ * @brief Lightweight local HTTP/JSON server answering forecast requests
+ */
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <map>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "YR_server.h"
+
+using json = nlohmann::json;
+
+namespace yr
+{
+    struct ForecastServer::Connection
+    {
+        int fd = -1;
+        uint64_t id = 0;
+        std::string in; // Bytes received but not yet handled
+        std::string out; // Bytes still to be sent
+        size_t out_offset = 0;
+        bool waiting = false; // Waiting on a fetch, later requests held back
+        bool close_after_write = false;
+        bool want_write = false; // Output queued, watch for EPOLLOUT
+        uint32_t events = EPOLLIN; // Events registered with epoll
+    };
+
+    struct ForecastServer::Loop
+    {
+        int epoll_fd = -1;
+        int event_fd = -1; // Signalled by the fetch threads
+        std::thread thread;
+        uint64_t next_id = 0;
+        std::unordered_map<int, Connection> connections;
+        // Connections waiting on each fetch, by fd and connection id
+        std::map<std::string, std::vector<std::pair<int, uint64_t>>> waiting;
+        // Fetches completed by the fetch threads, key and response
+        std::mutex done_mutex;
+        std::vector<std::pair<std::string, std::shared_ptr<const std::string>>> done;
+    };
+
+    namespace
+    {
+        // Parsed request line and the headers we care about
+        struct HttpRequest
+        {
+            std::string method;
+            std::string path;
+            std::string query;
+            bool keep_alive = true;
+            bool has_body = false;
+        };
+
+        const char *statusText(int status)
+        {
+            switch (status)
+            {
+                case 200: return "OK";
+                case 400: return "Bad Request";
+                case 404: return "Not Found";
+                case 405: return "Method Not Allowed";
+                case 431: return "Request Header Fields Too Large";
+                case 502: return "Bad Gateway";
+                default: return "Error";
+            }
+        }
+
+        std::string buildResponse(int status, const std::string &body, bool keep_alive)
+        {
+            std::string response = "HTTP/1.1 " + std::to_string(status) + " " +
+                statusText(status) + "\r\n";
+            response += "Content-Type: application/json\r\n";
+            response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+            response += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+            response += body;
+            return response;
+        }
+
+        std::string errorResponse(int status, const std::string &message, bool keep_alive)
+        {
+            json body;
+            body["error"] = message;
+            return buildResponse(status, body.dump(), keep_alive);
+        }
+
+        // Cached responses are stored keep-alive, rewrite for a closing request
+        std::string closingResponse(const std::string &response)
+        {
+            std::string closing = response;
+            const std::string keep_alive = "Connection: keep-alive\r\n";
+            size_t pos = closing.find(keep_alive);
+            if (pos != std::string::npos)
+            {
+                closing.replace(pos, keep_alive.size(), "Connection: close\r\n");
+            }
+            return closing;
+        }
+
+        bool equalsIgnoreCase(const std::string &a, const char *b)
+        {
+            size_t length = std::strlen(b);
+            if (a.size() != length)
+            {
+                return false;
+            }
+            return strncasecmp(a.c_str(), b, length) == 0;
+        }
+
+        std::string trim(const std::string &value)
+        {
+            size_t first = value.find_first_not_of(" \t");
+            if (first == std::string::npos)
+            {
+                return "";
+            }
+            size_t last = value.find_last_not_of(" \t");
+            return value.substr(first, last - first + 1);
+        }
+
+        bool parseRequestHead(const std::string &head, HttpRequest &request)
+        {
+            size_t line_end = head.find("\r\n");
+            std::string line = head.substr(0, line_end);
+            size_t first_space = line.find(' ');
+            size_t second_space = line.find(' ', first_space + 1);
+            if (first_space == std::string::npos || second_space == std::string::npos)
+            {
+                return false;
+            }
+            request.method = line.substr(0, first_space);
+            std::string target = line.substr(first_space + 1, second_space - first_space - 1);
+            std::string version = line.substr(second_space + 1);
+            if (version == "HTTP/1.1")
+            {
+                request.keep_alive = true;
+            }
+            else if (version == "HTTP/1.0")
+            {
+                request.keep_alive = false;
+            }
+            else
+            {
+                return false;
+            }
+            size_t query_start = target.find('?');
+            request.path = target.substr(0, query_start);
+            if (query_start != std::string::npos)
+            {
+                request.query = target.substr(query_start + 1);
+            }
+
+            // Headers
+            while (line_end != std::string::npos)
+            {
+                size_t start = line_end + 2;
+                line_end = head.find("\r\n", start);
+                line = head.substr(start, line_end == std::string::npos ?
+                                   std::string::npos : line_end - start);
+                size_t colon = line.find(':');
+                if (colon == std::string::npos)
+                {
+                    continue;
+                }
+                std::string name = trim(line.substr(0, colon));
+                std::string value = trim(line.substr(colon + 1));
+                if (equalsIgnoreCase(name, "connection"))
+                {
+                    if (equalsIgnoreCase(value, "close"))
+                    {
+                        request.keep_alive = false;
+                    }
+                    else if (equalsIgnoreCase(value, "keep-alive"))
+                    {
+                        request.keep_alive = true;
+                    }
+                }
+                else if (equalsIgnoreCase(name, "content-length"))
+                {
+                    request.has_body = request.has_body || std::atol(value.c_str()) != 0;
+                }
+                else if (equalsIgnoreCase(name, "transfer-encoding"))
+                {
+                    request.has_body = true;
+                }
+            }
+            return true;
+        }
+
+        // Find a query parameter, returns false if not present
+        bool queryParam(const std::string &query, const std::string &name, std::string &value)
+        {
+            size_t start = 0;
+            while (start <= query.size())
+            {
+                size_t end = query.find('&', start);
+                if (end == std::string::npos)
+                {
+                    end = query.size();
+                }
+                std::string pair = query.substr(start, end - start);
+                size_t equals = pair.find('=');
+                if (equals != std::string::npos && pair.substr(0, equals) == name)
+                {
+                    value = pair.substr(equals + 1);
+                    return true;
+                }
+                start = end + 1;
+            }
+            return false;
+        }
+
+        bool parseNumber(const std::string &text, double &value)
+        {
+            if (text.empty())
+            {
+                return false;
+            }
+            char *end = NULL;
+            value = std::strtod(text.c_str(), &end);
+            return *end == '\0' && std::isfinite(value);
+        }
+
+        // Shortest double that prints back as the float value
+        double floatToJSON(float value)
+        {
+            char buffer[32];
+            std::snprintf(buffer, sizeof(buffer), "%.7g", value);
+            return std::strtod(buffer, NULL);
+        }
+
+        bool setNonBlocking(int fd)
+        {
+            return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == 0;
+        }
+    } // namespace
+
+    ForecastServer::ForecastServer(const ForecastServerConfig &config, Fetcher fetcher)
+        : _config{config}
+        , _fetcher{fetcher}
+    {
+        if (!_fetcher)
+        {
+            _fetcher = [](float latitude, float longitude, int altitude)
+            {
+                YrForecast forecast(latitude, longitude, altitude);
+                try
+                {
+                    YrForecastStruct result = forecast.fetchForecast();
+                    forecast.curlCleanUp();
+                    return result;
+                }
+                catch (...)
+                {
+                    forecast.curlCleanUp();
+                    throw;
+                }
+            };
+        }
+    }
+
+    ForecastServer::~ForecastServer()
+    {
+        stop();
+    }
+
+    bool ForecastServer::start()
+    {
+        if (_running)
+        {
+            return true;
+        }
+        _listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (_listen_fd < 0 || !setNonBlocking(_listen_fd))
+        {
+            std::cout << "Failed to create server socket: " << std::strerror(errno) << std::endl;
+            stop();
+            return false;
+        }
+        int one = 1;
+        setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(_config.port);
+        if (inet_pton(AF_INET, _config.bind_address.c_str(), &address.sin_addr) != 1)
+        {
+            std::cout << "Invalid bind address: " << _config.bind_address << std::endl;
+            stop();
+            return false;
+        }
+        if (bind(_listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            listen(_listen_fd, SOMAXCONN) != 0)
+        {
+            std::cout << "Failed to bind server socket: " << std::strerror(errno) << std::endl;
+            stop();
+            return false;
+        }
+        socklen_t length = sizeof(address);
+        getsockname(_listen_fd, reinterpret_cast<sockaddr *>(&address), &length);
+        _port = ntohs(address.sin_port);
+
+        // Every loop waits on the listening socket, the kernel wakes one of them
+        int loop_count = _config.loop_threads > 0 ? _config.loop_threads : 1;
+        for (int i = 0; i < loop_count; i++)
+        {
+            std::unique_ptr<Loop> loop(new Loop());
+            loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            loop->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            epoll_event listen_event;
+            std::memset(&listen_event, 0, sizeof(listen_event));
+            listen_event.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+            listen_event.events |= EPOLLEXCLUSIVE;
+#endif
+            listen_event.data.fd = _listen_fd;
+            epoll_event wake_event;
+            std::memset(&wake_event, 0, sizeof(wake_event));
+            wake_event.events = EPOLLIN;
+            wake_event.data.fd = loop->event_fd;
+            bool loop_ok = loop->epoll_fd >= 0 && loop->event_fd >= 0 &&
+                epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, _listen_fd, &listen_event) == 0 &&
+                epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->event_fd, &wake_event) == 0;
+            _loops.push_back(std::move(loop));
+            if (!loop_ok)
+            {
+                std::cout << "Failed to create event loop: " << std::strerror(errno) << std::endl;
+                stop();
+                return false;
+            }
+        }
+
+        _running = true;
+        _fetch_stop = false;
+        int fetch_count = _config.fetch_threads > 0 ? _config.fetch_threads : 1;
+        for (int i = 0; i < fetch_count; i++)
+        {
+            _fetch_threads.push_back(std::thread(&ForecastServer::runFetchWorker, this));
+        }
+        for (auto &loop : _loops)
+        {
+            Loop *loop_ptr = loop.get();
+            loop->thread = std::thread([this, loop_ptr]() { runLoop(*loop_ptr); });
+        }
+        return true;
+    }
+
+    void ForecastServer::stop()
+    {
+        _running = false;
+        // Wake the loops so they see the flag
+        for (auto &loop : _loops)
+        {
+            uint64_t one = 1;
+            if (loop->event_fd >= 0 && write(loop->event_fd, &one, sizeof(one)) < 0)
+            {
+                // Loop still exits on its epoll timeout
+            }
+        }
+        for (auto &loop : _loops)
+        {
+            if (loop->thread.joinable())
+            {
+                loop->thread.join();
+            }
+        }
+        // Loops are only freed once no fetch thread can post to them
+        {
+            std::lock_guard<std::mutex> lock(_fetch_mutex);
+            _fetch_stop = true;
+            _fetch_jobs.clear();
+        }
+        _fetch_cv.notify_all();
+        for (auto &thread : _fetch_threads)
+        {
+            thread.join();
+        }
+        _fetch_threads.clear();
+        for (auto &loop : _loops)
+        {
+            for (auto &item : loop->connections)
+            {
+                close(item.first);
+            }
+            if (loop->event_fd >= 0)
+            {
+                close(loop->event_fd);
+            }
+            if (loop->epoll_fd >= 0)
+            {
+                close(loop->epoll_fd);
+            }
+        }
+        _loops.clear();
+        if (_listen_fd >= 0)
+        {
+            close(_listen_fd);
+            _listen_fd = -1;
+        }
+    }
+
+    uint16_t ForecastServer::port() const
+    {
+        return _port;
+    }
+
+    ForecastServerStats ForecastServer::stats() const
+    {
+        ForecastServerStats stats;
+        stats.connections = _connections;
+        stats.requests = _requests;
+        stats.cache_hits = _cache_hits;
+        stats.cache_misses = _cache_misses;
+        stats.fetches = _fetches;
+        stats.fetch_errors = _fetch_errors;
+        return stats;
+    }
+
+    std::string ForecastServer::forecastToJSON(float latitude, float longitude,
+                                               int altitude,
+                                               const YrForecastStruct &forecast)
+    {
+        json body;
+        body["latitude"] = floatToJSON(latitude);
+        body["longitude"] = floatToJSON(longitude);
+        body["altitude"] = altitude;
+        body["air_pressure_at_sea_level"] = floatToJSON(forecast.air_pressure_at_sea_level);
+        body["temperature"] = floatToJSON(forecast.temperature);
+        body["cloud_area_fraction"] = floatToJSON(forecast.cloud_area_fraction);
+        body["relative_humidity"] = floatToJSON(forecast.relative_humidity);
+        body["wind_direction"] = floatToJSON(forecast.wind_direction);
+        body["wind_speed"] = floatToJSON(forecast.wind_speed);
+        body["precipitation_amount"] = floatToJSON(forecast.precipitation_amount);
+        // forecast_summary holds the symbol code as dumped JSON
+        json summary = json::parse(forecast.forecast_summary, nullptr, false);
+        body["summary"] = summary.is_discarded() ? json(forecast.forecast_summary) : summary;
+        return body.dump();
+    }
+
+    void ForecastServer::runLoop(Loop &loop)
+    {
+        const int max_events = 256;
+        epoll_event events[max_events];
+        while (_running)
+        {
+            int count = epoll_wait(loop.epoll_fd, events, max_events, 200);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                std::cout << "Event loop failed: " << std::strerror(errno) << std::endl;
+                break;
+            }
+            for (int i = 0; i < count && _running; i++)
+            {
+                int fd = events[i].data.fd;
+                if (fd == _listen_fd)
+                {
+                    acceptConnections(loop);
+                    continue;
+                }
+                if (fd == loop.event_fd)
+                {
+                    uint64_t value;
+                    if (read(loop.event_fd, &value, sizeof(value)) < 0)
+                    {
+                        // Already drained, deliver anyway
+                    }
+                    deliverFetches(loop);
+                    continue;
+                }
+                auto it = loop.connections.find(fd);
+                if (it == loop.connections.end())
+                {
+                    continue;
+                }
+                Connection &conn = it->second;
+                if (events[i].events & (EPOLLHUP | EPOLLERR))
+                {
+                    closeConnection(loop, fd);
+                    continue;
+                }
+                if ((events[i].events & EPOLLOUT) && !flushConnection(loop, conn))
+                {
+                    continue;
+                }
+                if (events[i].events & EPOLLIN)
+                {
+                    readConnection(loop, conn);
+                }
+                else if ((events[i].events & EPOLLOUT) && !conn.in.empty())
+                {
+                    // Output has drained, answer the requests held back meanwhile
+                    processRequests(loop, conn);
+                }
+            }
+        }
+    }
+
+    void ForecastServer::acceptConnections(Loop &loop)
+    {
+        while (true)
+        {
+            int fd = accept4(_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                // EAGAIN, or another loop took the connection
+                return;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            epoll_event event;
+            std::memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+            {
+                close(fd);
+                continue;
+            }
+            Connection &conn = loop.connections[fd];
+            conn.fd = fd;
+            conn.id = ++loop.next_id;
+            _connections++;
+        }
+    }
+
+    void ForecastServer::readConnection(Loop &loop, Connection &conn)
+    {
+        char buffer[16384];
+        while (true)
+        {
+            ssize_t received = recv(conn.fd, buffer, sizeof(buffer), 0);
+            if (received > 0)
+            {
+                conn.in.append(buffer, received);
+                // Leave the rest in the socket until these requests are handled
+                if (static_cast<size_t>(received) < sizeof(buffer) ||
+                    conn.in.size() > _config.max_request_bytes)
+                {
+                    break;
+                }
+                continue;
+            }
+            if (received < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            // Peer closed or socket error
+            closeConnection(loop, conn.fd);
+            return;
+        }
+        processRequests(loop, conn);
+    }
+
+    void ForecastServer::processRequests(Loop &loop, Connection &conn)
+    {
+        // Requests are answered in order, stop at one waiting on a fetch or
+        // when the client isn't reading its responses
+        while (!conn.waiting && !conn.close_after_write && !outputFull(conn))
+        {
+            size_t head_end = conn.in.find("\r\n\r\n");
+            if (head_end == std::string::npos)
+            {
+                if (conn.in.size() > _config.max_request_bytes)
+                {
+                    conn.close_after_write = true;
+                    sendResponse(loop, conn, errorResponse(431, "request too large", false));
+                }
+                return;
+            }
+            if (head_end > _config.max_request_bytes)
+            {
+                conn.close_after_write = true;
+                sendResponse(loop, conn, errorResponse(431, "request too large", false));
+                return;
+            }
+            std::string head = conn.in.substr(0, head_end);
+            conn.in.erase(0, head_end + 4);
+            _requests++;
+
+            HttpRequest request;
+            if (!parseRequestHead(head, request) || request.has_body)
+            {
+                // Can't tell where the next request starts, give up on the connection
+                conn.close_after_write = true;
+                sendResponse(loop, conn, errorResponse(400, "malformed request", false));
+                return;
+            }
+            conn.close_after_write = !request.keep_alive;
+            bool keep_alive = request.keep_alive;
+
+            std::string response;
+            if (request.method != "GET")
+            {
+                response = errorResponse(405, "only GET is supported", keep_alive);
+            }
+            else if (request.path == "/stats")
+            {
+                ForecastServerStats server = stats();
+                SingleFlightStats flight = YrForecast::singleFlightStats();
+                json body;
+                body["connections"] = server.connections;
+                body["requests"] = server.requests;
+                body["cache_hits"] = server.cache_hits;
+                body["cache_misses"] = server.cache_misses;
+                body["fetches"] = server.fetches;
+                body["fetch_errors"] = server.fetch_errors;
+                body["coalesced_fetches"] = flight.coalesced;
+                response = buildResponse(200, body.dump(), keep_alive);
+            }
+            else if (request.path != "/forecast")
+            {
+                response = errorResponse(404, "unknown path", keep_alive);
+            }
+            else
+            {
+                std::string lat_text, lon_text, alt_text;
+                double latitude = 0.0, longitude = 0.0, altitude = 0.0;
+                bool valid = queryParam(request.query, "lat", lat_text) &&
+                    queryParam(request.query, "lon", lon_text) &&
+                    parseNumber(lat_text, latitude) && parseNumber(lon_text, longitude) &&
+                    -85.0 <= latitude && latitude <= 85.0 &&
+                    -180.0 <= longitude && longitude <= 180.0;
+                // Altitude is optional, defaults to sea level
+                if (valid && queryParam(request.query, "altitude", alt_text))
+                {
+                    valid = parseNumber(alt_text, altitude) &&
+                        -500.0 <= altitude && altitude <= 9000.0;
+                }
+                if (!valid)
+                {
+                    response = errorResponse(400, "lat and lon required, lat in [-85, 85], "
+                                             "lon in [-180, 180], altitude optional in "
+                                             "[-500, 9000] metres", keep_alive);
+                }
+                else
+                {
+                    // Yr only resolves 4 decimal places, round so nearby
+                    // requests share a cache entry
+                    FetchJob job;
+                    job.loop = &loop;
+                    job.latitude = static_cast<float>(std::round(latitude * 10000.0) / 10000.0);
+                    job.longitude = static_cast<float>(std::round(longitude * 10000.0) / 10000.0);
+                    job.altitude = static_cast<int>(altitude);
+                    char key[64];
+                    std::snprintf(key, sizeof(key), "%.4f,%.4f,%d",
+                                  job.latitude, job.longitude, job.altitude);
+                    job.key = key;
+
+                    std::shared_ptr<const std::string> cached = lookupCache(job.key);
+                    if (cached)
+                    {
+                        _cache_hits++;
+                        // Hits go out straight from the shared pre-serialized response
+                        bool open = keep_alive ? sendResponse(loop, conn, *cached) :
+                            sendResponse(loop, conn, closingResponse(*cached));
+                        if (!open)
+                        {
+                            return;
+                        }
+                        continue;
+                    }
+                    _cache_misses++;
+                    conn.waiting = true;
+                    // Stop reading until the fetch is answered, so a client
+                    // can't queue up unbounded input behind it
+                    watchConnection(loop, conn);
+                    std::vector<std::pair<int, uint64_t>> &waiters = loop.waiting[job.key];
+                    waiters.push_back(std::make_pair(conn.fd, conn.id));
+                    // One fetch per key per loop, later requests join the waiters
+                    if (waiters.size() == 1)
+                    {
+                        {
+                            std::lock_guard<std::mutex> lock(_fetch_mutex);
+                            _fetch_jobs.push_back(job);
+                        }
+                        _fetch_cv.notify_one();
+                    }
+                    return;
+                }
+            }
+            if (!sendResponse(loop, conn, response))
+            {
+                return;
+            }
+        }
+    }
+
+    /**
+     * @brief Queue a response and write as much as the socket takes
+     * @return bool False if the connection was closed
+     */
+    bool ForecastServer::sendResponse(Loop &loop, Connection &conn, const std::string &response)
+    {
+        if (conn.out_offset == conn.out.size())
+        {
+            // Nothing queued, write straight from the response
+            conn.out.clear();
+            conn.out_offset = 0;
+            ssize_t sent = send(conn.fd, response.data(), response.size(), MSG_NOSIGNAL);
+            if (sent < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                {
+                    closeConnection(loop, conn.fd);
+                    return false;
+                }
+                sent = 0;
+            }
+            conn.out.append(response, sent, std::string::npos);
+        }
+        else
+        {
+            conn.out.append(response);
+        }
+        return flushConnection(loop, conn);
+    }
+
+    /**
+     * @brief Write queued bytes, watching for EPOLLOUT while any remain
+     * @return bool False if the connection was closed
+     */
+    bool ForecastServer::flushConnection(Loop &loop, Connection &conn)
+    {
+        while (conn.out_offset < conn.out.size())
+        {
+            ssize_t sent = send(conn.fd, conn.out.data() + conn.out_offset,
+                                conn.out.size() - conn.out_offset, MSG_NOSIGNAL);
+            if (sent < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    break;
+                }
+                closeConnection(loop, conn.fd);
+                return false;
+            }
+            conn.out_offset += sent;
+        }
+        bool pending = conn.out_offset < conn.out.size();
+        if (!pending)
+        {
+            conn.out.clear();
+            conn.out_offset = 0;
+            if (conn.close_after_write && !conn.waiting)
+            {
+                closeConnection(loop, conn.fd);
+                return false;
+            }
+        }
+        conn.want_write = pending;
+        watchConnection(loop, conn);
+        return true;
+    }
+
+    /**
+     * @brief Register the events the connection needs, reading only while
+     * it can take another request and writing while output is queued
+     */
+    void ForecastServer::watchConnection(Loop &loop, Connection &conn)
+    {
+        uint32_t events = 0;
+        if (!conn.waiting && !conn.close_after_write && !outputFull(conn))
+        {
+            events |= EPOLLIN;
+        }
+        if (conn.want_write)
+        {
+            events |= EPOLLOUT;
+        }
+        if (events == conn.events)
+        {
+            return;
+        }
+        epoll_event event;
+        std::memset(&event, 0, sizeof(event));
+        event.events = events;
+        event.data.fd = conn.fd;
+        epoll_ctl(loop.epoll_fd, EPOLL_CTL_MOD, conn.fd, &event);
+        conn.events = events;
+    }
+
+    bool ForecastServer::outputFull(const Connection &conn) const
+    {
+        return conn.out.size() - conn.out_offset > _config.max_pending_output_bytes;
+    }
+
+    void ForecastServer::closeConnection(Loop &loop, int fd)
+    {
+        epoll_ctl(loop.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        close(fd);
+        loop.connections.erase(fd);
+    }
+
+    void ForecastServer::deliverFetches(Loop &loop)
+    {
+        std::vector<std::pair<std::string, std::shared_ptr<const std::string>>> done;
+        {
+            std::lock_guard<std::mutex> lock(loop.done_mutex);
+            done.swap(loop.done);
+        }
+        for (auto &item : done)
+        {
+            auto it = loop.waiting.find(item.first);
+            if (it == loop.waiting.end())
+            {
+                continue;
+            }
+            std::vector<std::pair<int, uint64_t>> waiters;
+            waiters.swap(it->second);
+            loop.waiting.erase(it);
+            for (auto &waiter : waiters)
+            {
+                auto conn_it = loop.connections.find(waiter.first);
+                // Connection gone, or fd reused by a newer connection
+                if (conn_it == loop.connections.end() || conn_it->second.id != waiter.second)
+                {
+                    continue;
+                }
+                Connection &conn = conn_it->second;
+                conn.waiting = false;
+                const std::string &response = *item.second;
+                bool open = conn.close_after_write ?
+                    sendResponse(loop, conn, closingResponse(response)) :
+                    sendResponse(loop, conn, response);
+                if (open)
+                {
+                    // Carry on with any requests pipelined behind this one
+                    processRequests(loop, conn);
+                }
+            }
+        }
+    }
+
+    void ForecastServer::runFetchWorker()
+    {
+        while (true)
+        {
+            FetchJob job;
+            {
+                std::unique_lock<std::mutex> lock(_fetch_mutex);
+                _fetch_cv.wait(lock, [this]() { return _fetch_stop || !_fetch_jobs.empty(); });
+                if (_fetch_stop)
+                {
+                    return;
+                }
+                job = _fetch_jobs.front();
+                _fetch_jobs.pop_front();
+            }
+            _fetches++;
+            std::shared_ptr<const std::string> response;
+            try
+            {
+                YrForecastStruct forecast = _fetcher(job.latitude, job.longitude, job.altitude);
+                response = std::make_shared<const std::string>(buildResponse(200,
+                    forecastToJSON(job.latitude, job.longitude, job.altitude, forecast), true));
+                storeCache(job.key, response);
+            }
+            catch (const std::exception &e)
+            {
+                _fetch_errors++;
+                response = std::make_shared<const std::string>(
+                    errorResponse(502, std::string("forecast fetch failed: ") + e.what(), true));
+            }
+            catch (...)
+            {
+                _fetch_errors++;
+                response = std::make_shared<const std::string>(
+                    errorResponse(502, "forecast fetch failed", true));
+            }
+            {
+                std::lock_guard<std::mutex> lock(job.loop->done_mutex);
+                job.loop->done.push_back(std::make_pair(job.key, response));
+            }
+            uint64_t one = 1;
+            if (write(job.loop->event_fd, &one, sizeof(one)) < 0)
+            {
+                // Counter saturated, the loop is already due to wake
+            }
+        }
+    }
+
+    std::shared_ptr<const std::string> ForecastServer::lookupCache(const std::string &key)
+    {
+        std::lock_guard<std::mutex> lock(_cache_mutex);
+        auto it = _cache.find(key);
+        if (it == _cache.end())
+        {
+            return std::shared_ptr<const std::string>();
+        }
+        if (it->second.expires <= std::chrono::steady_clock::now())
+        {
+            _cache.erase(it);
+            return std::shared_ptr<const std::string>();
+        }
+        return it->second.response;
+    }
+
+    void ForecastServer::storeCache(const std::string &key,
+                                    std::shared_ptr<const std::string> response)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(_cache_mutex);
+        if (_cache.size() >= _config.max_cache_entries && _cache.find(key) == _cache.end())
+        {
+            // Sweep expired entries, then make room if still full
+            for (auto it = _cache.begin(); it != _cache.end();)
+            {
+                it = it->second.expires <= now ? _cache.erase(it) : std::next(it);
+            }
+            if (_cache.size() >= _config.max_cache_entries && !_cache.empty())
+            {
+                _cache.erase(_cache.begin());
+            }
+        }
+        CacheEntry &entry = _cache[key];
+        entry.response = response;
+        entry.expires = now + std::chrono::seconds(_config.cache_ttl_seconds);
+    }
+
+} // namespace yr
@@ -0,0 +1,185 @@
+/**
+ * @file YR_server.h
+ * @brief Lightweight local HTTP/JSON server answering forecast requests
+ *
+ * Serves GET /forecast?lat=Y&lon=Z&altitude=X from an in-memory cache of
+ * pre-serialized responses, fetching from yr.no through the library on a
+ * miss. Linux only, the event loops are built on epoll.
+ */
+
+#ifndef YR_SERVER_H
+#define YR_SERVER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "YR_forecast.h"
+
+
+namespace yr
+{
+    /**
+     * @brief Settings for the forecast server
+     */
+    struct ForecastServerConfig
+    {
+        std::string bind_address = "127.0.0.1";
+        uint16_t port = 8080; // 0 picks a free port, see ForecastServer::port()
+        int loop_threads = 1; // Event loops sharing the listening socket
+        int fetch_threads = 4; // Threads running fetches on a cache miss
+        int cache_ttl_seconds = 600; // How long a forecast is served from cache
+        size_t max_cache_entries = 100000;
+        size_t max_request_bytes = 8192; // Larger request heads are rejected
+        // Stop reading requests from a connection while more than this much of
+        // its responses is waiting to be sent
+        size_t max_pending_output_bytes = 1 << 20;
+    };
+
+    /**
+     * @brief Snapshot of the server counters
+     */
+    struct ForecastServerStats
+    {
+        uint64_t connections;
+        uint64_t requests;
+        uint64_t cache_hits;
+        uint64_t cache_misses;
+        uint64_t fetches;
+        uint64_t fetch_errors;
+    };
+
+    /**
+     * @brief HTTP/1.1 server with keep-alive in front of the forecast library
+     */
+    class ForecastServer
+    {
+
+    public:
+    /**
+     * @brief Function returning the forecast for a location
+     *
+     * Called from the fetch threads, may throw to report a failure.
+     */
+        typedef std::function<YrForecastStruct(float latitude, float longitude,
+                                               int altitude)> Fetcher;
+
+    /**
+     * @brief Construct a new ForecastServer object
+     * @param config Server settings
+     * @param fetcher Fetch function, defaults to YrForecast::fetchForecast()
+     */
+        explicit ForecastServer(const ForecastServerConfig &config,
+                                Fetcher fetcher = Fetcher());
+
+    /**
+     * @brief Destructor, stops the server if running
+     */
+        ~ForecastServer();
+
+        ForecastServer(const ForecastServer &) = delete;
+        ForecastServer &operator=(const ForecastServer &) = delete;
+
+    /**
+     * @brief Bind the socket and start the event loops
+     * @return bool False if the socket could not be set up
+     */
+        bool start();
+
+    /**
+     * @brief Stop the event loops and close every connection
+     */
+        void stop();
+
+    /**
+     * @brief Port the server is listening on
+     */
+        uint16_t port() const;
+
+    /**
+     * @brief Get the current counters
+     */
+        ForecastServerStats stats() const;
+
+    /**
+     * @brief Serialize a forecast into the JSON body served by /forecast
+     */
+        static std::string forecastToJSON(float latitude, float longitude,
+                                          int altitude,
+                                          const YrForecastStruct &forecast);
+
+    private:
+        struct Loop;
+        struct Connection;
+
+        // Pre-serialized keep-alive response for a location
+        struct CacheEntry
+        {
+            std::shared_ptr<const std::string> response;
+            std::chrono::steady_clock::time_point expires;
+        };
+
+        // Fetch handed from an event loop to the fetch threads
+        struct FetchJob
+        {
+            Loop *loop;
+            std::string key;
+            float latitude;
+            float longitude;
+            int altitude;
+        };
+
+        void runLoop(Loop &loop);
+        void acceptConnections(Loop &loop);
+        void readConnection(Loop &loop, Connection &conn);
+        void processRequests(Loop &loop, Connection &conn);
+        bool sendResponse(Loop &loop, Connection &conn, const std::string &response);
+        bool flushConnection(Loop &loop, Connection &conn);
+        void watchConnection(Loop &loop, Connection &conn);
+        bool outputFull(const Connection &conn) const;
+        void closeConnection(Loop &loop, int fd);
+        void deliverFetches(Loop &loop);
+        void runFetchWorker();
+
+        std::shared_ptr<const std::string> lookupCache(const std::string &key);
+        void storeCache(const std::string &key, std::shared_ptr<const std::string> response);
+
+        ForecastServerConfig _config;
+        Fetcher _fetcher;
+        int _listen_fd = -1;
+        uint16_t _port = 0;
+        std::atomic<bool> _running{false};
+        std::vector<std::unique_ptr<Loop>> _loops;
+
+        // Response cache, shared by every loop
+        std::mutex _cache_mutex;
+        std::unordered_map<std::string, CacheEntry> _cache;
+
+        // Fetch threads
+        std::mutex _fetch_mutex;
+        std::condition_variable _fetch_cv;
+        std::deque<FetchJob> _fetch_jobs;
+        std::vector<std::thread> _fetch_threads;
+        bool _fetch_stop = false;
+
+        // Counters
+        std::atomic<uint64_t> _connections{0};
+        std::atomic<uint64_t> _requests{0};
+        std::atomic<uint64_t> _cache_hits{0};
+        std::atomic<uint64_t> _cache_misses{0};
+        std::atomic<uint64_t> _fetches{0};
+        std::atomic<uint64_t> _fetch_errors{0};
+    };
+
+} // namespace yr
+
+#endif //YR_SERVER_H
@@ -0,0 +1,136 @@
+/**
+ * @file YR_singleflight.h
+ * @brief Coalesce identical in-flight requests so only one caller does the work
+ */
+
+#ifndef YR_SINGLEFLIGHT_H
+#define YR_SINGLEFLIGHT_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+
+namespace yr
+{
+    /**
+     * @brief Snapshot of the single-flight counters
+     */
+    struct SingleFlightStats
+    {
+        uint64_t requests;  // Total calls to run()
+        uint64_t executions; // Calls that performed the work themselves
+        uint64_t coalesced; // Calls that waited on another caller's result
+    };
+
+    /**
+     * @brief Template class giving single-flight semantics per key
+     *
+     * The first caller for a key runs the function, every caller arriving
+     * while that call is still in flight waits for and shares its result.
+     * Once the call completes the key is forgotten, so the next caller
+     * starts a fresh call. Exceptions thrown by the function are passed on
+     * to every waiting caller.
+     */
+    template <typename T>
+    class SingleFlight
+    {
+
+    public:
+        SingleFlight() = default;
+        SingleFlight(const SingleFlight &) = delete;
+        SingleFlight &operator=(const SingleFlight &) = delete;
+
+    /**
+     * @brief Run fn for key, or wait on the call already in flight for key
+     * @param key Key identifying identical requests, e.g. the request URL
+     * @param fn Function producing the result
+     * @return T The shared result
+     */
+        T run(const std::string &key, const std::function<T()> &fn)
+        {
+            _requests++;
+            std::shared_future<T> result;
+            std::promise<T> promise;
+            bool leader = false;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                auto it = _in_flight.find(key);
+                if (it != _in_flight.end())
+                {
+                    result = it->second;
+                }
+                else
+                {
+                    result = promise.get_future().share();
+                    _in_flight[key] = result;
+                    leader = true;
+                }
+            }
+            if (!leader)
+            {
+                _coalesced++;
+                return result.get();
+            }
+
+            _executions++;
+            // Forget the key before waking anyone, later callers start
+            // afresh while the waiters keep their own shared_future
+            auto forget = [this, &key]()
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _in_flight.erase(key);
+            };
+            try
+            {
+                T value = fn();
+                forget();
+                promise.set_value(std::move(value));
+            }
+            catch (...)
+            {
+                forget();
+                promise.set_exception(std::current_exception());
+            }
+            return result.get();
+        }
+
+    /**
+     * @brief Number of keys currently in flight
+     */
+        size_t inFlight()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _in_flight.size();
+        }
+
+    /**
+     * @brief Get the current counters
+     */
+        SingleFlightStats stats() const
+        {
+            SingleFlightStats stats;
+            stats.requests = _requests;
+            stats.executions = _executions;
+            stats.coalesced = _coalesced;
+            return stats;
+        }
+
+    private:
+        std::mutex _mutex;
+        std::map<std::string, std::shared_future<T>> _in_flight;
+
+        // Counters
+        std::atomic<uint64_t> _requests{0};
+        std::atomic<uint64_t> _executions{0};
+        std::atomic<uint64_t> _coalesced{0};
+    };
+
+} // namespace yr
+
+#endif //YR_SINGLEFLIGHT_H
@@ -0,0 +1,47 @@
+/**
+ * @file server_main.cpp
+ * @brief main() function for the local forecast server
+ */
+
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include "YR_server.h"
+
+
+int main(int argc, char **argv) {
+
+    yr::ForecastServerConfig config;
+    // Optional arguments: port, event loop threads, fetch threads
+    if (argc > 1)
+    {
+        config.port = static_cast<uint16_t>(std::atoi(argv[1]));
+    }
+    if (argc > 2)
+    {
+        config.loop_threads = std::atoi(argv[2]);
+    }
+    if (argc > 3)
+    {
+        config.fetch_threads = std::atoi(argv[3]);
+    }
+    // Block the stop signals before any thread starts, then wait for one
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    yr::ForecastServer server(config);
+    if (!server.start())
+    {
+        return EXIT_FAILURE;
+    }
+    std::cout << "Serving forecasts on http://" << config.bind_address << ":";
+    std::cout << server.port() << "/forecast?lat=Y&lon=Z&altitude=X" << std::endl;
+    int signal_number = 0;
+    sigwait(&signals, &signal_number);
+    std::cout << "Stopping server." << std::endl;
+    server.stop();
+    return 0;
+}
@@ -1,6 +1,43 @@
 #include "gtest/gtest.h"
 #include "YR_forecast.h"
+#include "YR_pipeline.h"
+#include "YR_archive.h"
+#include "YR_history.h"
+#include "YR_projection.h"
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+#include <functional>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef YR_FORECAST_SERVER
+#include "YR_server.h"
+#endif
+
+#ifndef YR_TEST_DATA_DIR
+#define YR_TEST_DATA_DIR "."
+#endif
+
+// Read a fixture from the source tree
+static std::string readTestData(const std::string &name)
+{
+    std::string data;
+    std::ifstream myfile(std::string(YR_TEST_DATA_DIR) + "/" + name);
+    std::getline(myfile, data);
+    myfile.close();
+    return data;
+}
 
 // Test the URL
 TEST(TestURL, When_PassedIntValues_ExpectCorrectUrl){
@@ -16,6 +53,16 @@ TEST(TestURL, When_PassedIntValues_ExpectCorrectUrl){
     EXPECT_STRCASEEQ(test_url.c_str(), control_url.c_str());
 
 }
+TEST(TestURL, When_CompleteProduct_ExpectCompleteUrl){
+    yr::YrForecast test_forecast(50, 50, 50);
+    test_forecast.createURL();
+    test_forecast.setProduct(yr::ForecastProduct::Complete);
+    EXPECT_EQ(test_forecast.getURL(),
+        "https://api.met.no/weatherapi/locationforecast/2.0/complete.json?altitude=50&lat=50.000000&lon=50.000000");
+    test_forecast.setProduct(yr::ForecastProduct::Compact);
+    EXPECT_EQ(test_forecast.getURL(),
+        "https://api.met.no/weatherapi/locationforecast/2.0/compact.json?altitude=50&lat=50.000000&lon=50.000000");
+}
 TEST(TestPopulateForecastData, When_NoURL_ExpectPrintedError){
     // Set up yr object
     int test_lat = 50;
@@ -49,6 +96,26 @@ TEST(TestPopulateForecastData, When_CurlNotInit_Expect_PrintedError){
 
     EXPECT_STREQ(returned_from_test_forecast.c_str(), actual_response.c_str());
 }
+TEST(TestPopulateForecastData, When_CurlHandleNullPointer_Expect_PrintedError){
+    // Set up yr object
+    int test_lat = 50;
+    int test_lon =50; 
+    int test_alt = 50;
+    yr::YrForecast test_forecast(test_lat, test_lon, test_alt);
+    // Create URL sets _URL_complete true
+    test_forecast.createURL();
+    std::string url = test_forecast.getURL();
+    CURLcode test_code = CURLE_OK;
+    CURL *test_easyhandle = NULL;
+    std::string returned_from_test_forecast =
+        test_forecast.populateForecastData(url,test_easyhandle, test_code);
+    // Expected, no longer exits
+    std::string actual_response = "Error, Failed to create CURL connection.\n";
+
+    EXPECT_STREQ(returned_from_test_forecast.c_str(), actual_response.c_str());
+    yr::FetchResult result = test_forecast.fetchForecastData(url, test_easyhandle);
+    EXPECT_EQ(result.status, yr::FetchStatus::NotInitialised);
+}
 // Test the weather struct
 TEST(TestWeatherStruct, When_JSONParsed_Expect_WeatherStructCorrect)
 {
@@ -58,10 +125,7 @@ TEST(TestWeatherStruct, When_JSONParsed_Expect_WeatherStructCorrect)
     int test_alt = 50;
     yr::YrForecast test_forecast(test_lat, test_lon, test_alt);
     yr::YrForecastStruct test_weather_struct;
-    std::string data;
-    std::ifstream myfile("/Users/magnoliaann2e/Documents/YR_App/yr_weather/test_weather_data.txt");
-    std::getline(myfile, data);
-    myfile.close();
+    std::string data = readTestData("test_weather_data.txt");
     // Control data values taken from text file
     std::string summary = "\"cloudy\"";
     float pressure = 1041.5;
@@ -187,6 +251,992 @@ TEST(TestHandleGeoCoords_Altitude, When_AltIsString_Expect_Default){
     // Expect equal
     EXPECT_EQ(returned_alt, 0);
 }
+// Test the single-flight request coalescing
+TEST(TestSingleFlight, When_ConcurrentSameKey_Expect_OneExecution){
+    yr::SingleFlight<int> flight;
+    const int callers = 8;
+    std::atomic<int> executions{0};
+    std::vector<int> results(callers, 0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < callers; i++)
+    {
+        threads.push_back(std::thread([&, i]()
+        {
+            results[i] = flight.run("same-url", [&]()
+            {
+                executions++;
+                // Hold the call open until every other caller is waiting on it
+                auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+                while (flight.stats().coalesced < callers - 1 &&
+                       std::chrono::steady_clock::now() < deadline)
+                {
+                    std::this_thread::yield();
+                }
+                return 42;
+            });
+        }));
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    yr::SingleFlightStats stats = flight.stats();
+    EXPECT_EQ(executions, 1);
+    EXPECT_EQ(stats.requests, callers);
+    EXPECT_EQ(stats.executions, 1);
+    EXPECT_EQ(stats.coalesced, callers - 1);
+    EXPECT_EQ(flight.inFlight(), 0);
+    for (int result : results)
+    {
+        EXPECT_EQ(result, 42);
+    }
+}
+TEST(TestSingleFlight, When_SequentialCalls_Expect_EachExecutes){
+    yr::SingleFlight<int> flight;
+    int executions = 0;
+    flight.run("url", [&]() { return ++executions; });
+    int second = flight.run("url", [&]() { return ++executions; });
+    EXPECT_EQ(second, 2);
+    EXPECT_EQ(flight.stats().coalesced, 0);
+}
+TEST(TestSingleFlight, When_FunctionThrows_Expect_ExceptionPassedOn){
+    yr::SingleFlight<int> flight;
+    EXPECT_ANY_THROW(flight.run("url", []() -> int { throw std::runtime_error("failed"); }));
+    // Key is released after a failure
+    EXPECT_EQ(flight.run("url", []() { return 1; }), 1);
+}
+// Local HTTP server answering each request per a script, for transfer tests
+class StubHttpServer
+{
+public:
+    struct Reply
+    {
+        int delay_ms;
+        int status;
+        std::string body;
+    };
+    // Script is given the 0-based request number
+    explicit StubHttpServer(std::function<Reply(int)> script) : _script(script)
+    {
+        _listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+        bind(_listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+        listen(_listen_fd, 16);
+        socklen_t length = sizeof(address);
+        getsockname(_listen_fd, reinterpret_cast<sockaddr *>(&address), &length);
+        _port = ntohs(address.sin_port);
+        _accept_thread = std::thread([this]() { acceptLoop(); });
+    }
+    ~StubHttpServer()
+    {
+        _stop = true;
+        shutdown(_listen_fd, SHUT_RDWR);
+        close(_listen_fd);
+        _accept_thread.join();
+        for (auto &thread : _threads)
+        {
+            thread.join();
+        }
+    }
+    std::string url(const std::string &path = "/forecast") const
+    {
+        return "http://127.0.0.1:" + std::to_string(_port) + path;
+    }
+    int requests() const { return _requests; }
+
+private:
+    void acceptLoop()
+    {
+        while (!_stop)
+        {
+            int fd = accept(_listen_fd, NULL, NULL);
+            if (fd < 0)
+            {
+                return;
+            }
+            int number = _requests++;
+            _threads.push_back(std::thread([this, fd, number]() { serve(fd, number); }));
+        }
+    }
+    void serve(int fd, int number)
+    {
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos)
+        {
+            ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+            if (received <= 0)
+            {
+                close(fd);
+                return;
+            }
+            request.append(buffer, received);
+        }
+        Reply reply = _script(number);
+        // Sleep in slices so the destructor isn't held up
+        auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(reply.delay_ms);
+        while (!_stop && std::chrono::steady_clock::now() < until)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        std::string response = "HTTP/1.1 " + std::to_string(reply.status) + " Stub\r\n"
+            "Content-Length: " + std::to_string(reply.body.size()) + "\r\n"
+            "Connection: close\r\n\r\n" + reply.body;
+        send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+        close(fd);
+    }
+
+    std::function<Reply(int)> _script;
+    int _listen_fd;
+    uint16_t _port;
+    std::atomic<bool> _stop{false};
+    std::atomic<int> _requests{0};
+    std::thread _accept_thread;
+    std::vector<std::thread> _threads;
+};
+// Test retries, timeouts and hedging
+TEST(TestFetchForecastData, When_ServerErrorsThenRecovers_Expect_Retried){
+    StubHttpServer stub([](int number)
+    {
+        StubHttpServer::Reply reply = {0, number < 2 ? 503 : 200, number < 2 ? "" : "{}"};
+        return reply;
+    });
+    yr::YrForecast test_forecast(50, 50, 50);
+    yr::FetchOptions options;
+    options.max_attempts = 3;
+    options.backoff_base_ms = 1;
+    test_forecast.setFetchOptions(options);
+    CURL *handle = curl_easy_init();
+    yr::FetchResult result = test_forecast.fetchForecastData(stub.url(), handle);
+    curl_easy_cleanup(handle);
+
+    EXPECT_TRUE(result.ok());
+    EXPECT_EQ(result.attempts, 3);
+    EXPECT_EQ(result.http_status, 200);
+    EXPECT_EQ(result.body, "{}");
+}
+TEST(TestFetchForecastData, When_NotFound_Expect_NoRetry){
+    StubHttpServer stub([](int)
+    {
+        StubHttpServer::Reply reply = {0, 404, ""};
+        return reply;
+    });
+    yr::YrForecast test_forecast(50, 50, 50);
+    CURL *handle = curl_easy_init();
+    yr::FetchResult result = test_forecast.fetchForecastData(stub.url(), handle);
+    curl_easy_cleanup(handle);
+
+    EXPECT_EQ(result.status, yr::FetchStatus::HttpError);
+    EXPECT_EQ(result.http_status, 404);
+    EXPECT_EQ(result.attempts, 1);
+    EXPECT_EQ(stub.requests(), 1);
+}
+TEST(TestFetchForecastData, When_ResponseSlow_Expect_TimeoutError){
+    StubHttpServer stub([](int)
+    {
+        StubHttpServer::Reply reply = {2000, 200, "{}"};
+        return reply;
+    });
+    yr::YrForecast test_forecast(50, 50, 50);
+    yr::FetchOptions options;
+    options.total_timeout_ms = 100;
+    options.max_attempts = 1;
+    test_forecast.setFetchOptions(options);
+    auto start = std::chrono::steady_clock::now();
+    CURL *handle = curl_easy_init();
+    yr::FetchResult result = test_forecast.fetchForecastData(stub.url(), handle);
+    curl_easy_cleanup(handle);
+
+    EXPECT_EQ(result.status, yr::FetchStatus::TransferFailed);
+    EXPECT_EQ(result.curl_code, CURLE_OPERATION_TIMEDOUT);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+}
+TEST(TestFetchForecastData, When_AttemptSlow_Expect_HedgedRequestWins){
+    // Requests 0-19 are quick and set the latency percentile,
+    // request 20 stalls and its hedge, request 21, answers quickly
+    StubHttpServer stub([](int number)
+    {
+        StubHttpServer::Reply reply = {number == 20 ? 3000 : 0, 200,
+                                       number == 20 ? "slow" : "fast"};
+        return reply;
+    });
+    yr::YrForecast test_forecast(50, 50, 50);
+    yr::FetchOptions options;
+    options.hedge = true;
+    options.hedge_min_samples = 20;
+    options.max_attempts = 1;
+    test_forecast.setFetchOptions(options);
+    CURL *handle = curl_easy_init();
+    for (int i = 0; i < 20; i++)
+    {
+        ASSERT_TRUE(test_forecast.fetchForecastData(stub.url(), handle).ok());
+    }
+    auto start = std::chrono::steady_clock::now();
+    yr::FetchResult result = test_forecast.fetchForecastData(stub.url(), handle);
+    curl_easy_cleanup(handle);
+
+    EXPECT_TRUE(result.ok());
+    EXPECT_TRUE(result.hedged);
+    EXPECT_EQ(result.body, "fast");
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(2));
+}
+
+// Test the record/replay archive
+TEST(TestArchive, When_RecordsWritten_Expect_ReadBackByIndexAndURL){
+    std::string path = testing::TempDir() + "yr_archive_test.yra";
+    std::string forecast = readTestData("test_weather_data.txt");
+    {
+        yr::ArchiveWriter writer(path);
+        ASSERT_TRUE(writer.isOpen());
+        yr::ArchiveRecord record;
+        record.url = "https://example/a";
+        record.http_status = 200;
+        record.headers = "HTTP/1.1 200 OK\r\n\r\n";
+        record.offset_ms = 20;
+        record.duration_ms = 5;
+        record.body = forecast;
+        EXPECT_TRUE(writer.append(record));
+        record.url = "https://example/b";
+        record.offset_ms = 10;
+        record.body = "second";
+        EXPECT_TRUE(writer.append(record));
+        record.url = "https://example/a";
+        record.offset_ms = 30;
+        record.body = "third";
+        EXPECT_TRUE(writer.append(record));
+    }
+    yr::ArchiveReader reader(path);
+    ASSERT_TRUE(reader.isOpen());
+    ASSERT_EQ(reader.size(), 3u);
+    yr::ArchiveRecord record;
+    ASSERT_TRUE(reader.read(0, record));
+    EXPECT_EQ(record.body, forecast);
+    EXPECT_EQ(record.headers, "HTTP/1.1 200 OK\r\n\r\n");
+    EXPECT_EQ(record.duration_ms, 5u);
+    // Same URL steps through its responses, then wraps
+    ASSERT_TRUE(reader.find("https://example/a", record));
+    EXPECT_EQ(record.body, forecast);
+    ASSERT_TRUE(reader.find("https://example/a", record));
+    EXPECT_EQ(record.body, "third");
+    ASSERT_TRUE(reader.find("https://example/a", record));
+    EXPECT_EQ(record.body, forecast);
+    EXPECT_FALSE(reader.find("https://example/c", record));
+    // Replay goes in start order
+    std::vector<std::string> bodies;
+    reader.replay(0, [&](const yr::ArchiveRecord &replayed) { bodies.push_back(replayed.body); });
+    ASSERT_EQ(bodies.size(), 3u);
+    EXPECT_EQ(bodies[0], "second");
+    EXPECT_EQ(bodies[2], "third");
+    // Forecast JSON compresses well
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    EXPECT_LT(static_cast<size_t>(file.tellg()), forecast.size() / 2);
+    std::remove(path.c_str());
+}
+TEST(TestArchive, When_RecordSizesCorrupt_Expect_ReadRefused){
+    std::string path = testing::TempDir() + "yr_archive_corrupt.yra";
+    // Body length, then compressed length, of the first record
+    for (size_t field : {8u + 28u, 8u + 32u})
+    {
+        {
+            yr::ArchiveWriter writer(path);
+            yr::ArchiveRecord record;
+            record.url = "https://example/a";
+            record.body = "body";
+            writer.append(record);
+        }
+        {
+            std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+            file.seekp(field);
+            file.write("\xff\xff\xff\x7f", 4);
+        }
+        yr::ArchiveReader reader(path);
+        ASSERT_TRUE(reader.isOpen());
+        yr::ArchiveRecord record;
+        EXPECT_FALSE(reader.read(0, record));
+        EXPECT_FALSE(reader.find("https://example/a", record));
+    }
+    std::remove(path.c_str());
+}
+TEST(TestArchive, When_WriterNotClosed_Expect_RecordsRecovered){
+    std::string path = testing::TempDir() + "yr_archive_unclosed.yra";
+    std::string copy = testing::TempDir() + "yr_archive_unclosed_copy.yra";
+    yr::ArchiveWriter writer(path);
+    yr::ArchiveRecord record;
+    record.url = "https://example/a";
+    record.body = "body";
+    writer.append(record);
+    writer.append(record);
+    // Copy the file before the index is written, as after a crash
+    {
+        std::ifstream source(path, std::ios::binary);
+        std::ofstream destination(copy, std::ios::binary);
+        destination << source.rdbuf();
+    }
+    yr::ArchiveReader reader(copy);
+    ASSERT_TRUE(reader.isOpen());
+    EXPECT_EQ(reader.size(), 2u);
+    writer.close();
+    std::remove(path.c_str());
+    std::remove(copy.c_str());
+}
+TEST(TestWeatherSeries, When_JSONParsed_Expect_EveryStep){
+    std::string data = readTestData("test_weather_data.txt");
+    yr::YrForecastSeries series = yr::YrForecast::parseForecastSeries(data);
+    yr::YrForecastStruct first = yr::YrForecast::parseForecastJSON(data);
+    // 2020-11-16T01:21:43Z, first step 2020-11-16T07:00:00Z
+    EXPECT_EQ(series.issue_time, 1605489703);
+    ASSERT_EQ(series.points.size(), 86u);
+    EXPECT_EQ(series.points[0].time, 1605510000);
+    EXPECT_EQ(series.points[1].time - series.points[0].time, 3600);
+    EXPECT_EQ(series.points[0].air_pressure_at_sea_level, first.air_pressure_at_sea_level);
+    EXPECT_EQ(series.points[0].temperature, first.temperature);
+    EXPECT_EQ(series.points[0].wind_speed, first.wind_speed);
+    EXPECT_EQ(series.points[0].precipitation_amount, first.precipitation_amount);
+    // Last step has no next_6_hours
+    EXPECT_TRUE(std::isnan(series.points.back().precipitation_amount));
+    EXPECT_THROW(yr::YrForecast::parseForecastSeries("not json"), std::exception);
+}
+// Compares floats bit for bit, so NaN and -0.0 must survive too
+static bool sameBits(const yr::YrForecastSeries &a, const yr::YrForecastSeries &b){
+    if (a.issue_time != b.issue_time || a.points.size() != b.points.size())
+    {
+        return false;
+    }
+    for (size_t i = 0; i < a.points.size(); i++)
+    {
+        const yr::YrForecastPoint &x = a.points[i];
+        const yr::YrForecastPoint &y = b.points[i];
+        const float xs[] = {x.air_pressure_at_sea_level, x.temperature, x.cloud_area_fraction,
+            x.relative_humidity, x.wind_direction, x.wind_speed, x.precipitation_amount};
+        const float ys[] = {y.air_pressure_at_sea_level, y.temperature, y.cloud_area_fraction,
+            y.relative_humidity, y.wind_direction, y.wind_speed, y.precipitation_amount};
+        if (x.time != y.time || std::memcmp(xs, ys, sizeof(xs)) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+TEST(TestHistoryStore, When_RunsAppended_Expect_RangeScanReturnsThem){
+    std::string directory = testing::TempDir() + "yr_history_test";
+    yr::HistoryStore store(directory);
+    ASSERT_TRUE(store.isOpen());
+    yr::ForecastLocation oslo = {59.9f, 10.7f, 10};
+    yr::ForecastLocation bergen = {60.4f, 5.3f, 12};
+    std::remove(store.path(oslo).c_str());
+    std::remove(store.path(bergen).c_str());
+    yr::YrForecastSeries base =
+        yr::YrForecast::parseForecastSeries(readTestData("test_weather_data.txt"));
+    // Values off the tenths grid, negative zero and NaN take the XOR path
+    base.points[3].temperature = 0.123f;
+    base.points[4].temperature = -0.0f;
+    base.points[5].wind_speed = std::nanf("");
+    std::vector<yr::YrForecastSeries> runs;
+    for (int run = 0; run < 4; run++)
+    {
+        yr::YrForecastSeries series = base;
+        series.issue_time += run * 3600;
+        for (auto &point : series.points)
+        {
+            point.temperature += run * 0.5f;
+        }
+        runs.push_back(series);
+        EXPECT_TRUE(store.append(oslo, series));
+        EXPECT_TRUE(store.append(bergen, base));
+    }
+    std::vector<yr::YrForecastSeries> found =
+        store.read(oslo, base.issue_time + 3600, base.issue_time + 2 * 3600);
+    ASSERT_EQ(found.size(), 2u);
+    EXPECT_TRUE(sameBits(found[0], runs[1]));
+    EXPECT_TRUE(sameBits(found[1], runs[2]));
+    EXPECT_EQ(store.read(bergen, 0, INT64_MAX).size(), 4u);
+    EXPECT_TRUE(store.read({0.0f, 0.0f, 0}, 0, INT64_MAX).empty());
+    // A block cut short is dropped by the next append
+    {
+        std::ofstream file(store.path(bergen), std::ios::binary | std::ios::app);
+        file << "YRHB partial";
+    }
+    EXPECT_EQ(store.read(bergen, 0, INT64_MAX).size(), 4u);
+    yr::HistoryStore reopened(directory);
+    EXPECT_TRUE(reopened.append(bergen, base));
+    EXPECT_EQ(reopened.read(bergen, 0, INT64_MAX).size(), 5u);
+    std::remove(store.path(oslo).c_str());
+    std::remove(store.path(bergen).c_str());
+}
+TEST(TestHistoryStore, When_AppendFails_Expect_PartialBlockRemoved){
+    std::string directory = testing::TempDir() + "yr_history_test";
+    yr::HistoryStore store(directory);
+    yr::ForecastLocation location = {1.0f, 2.0f, 3};
+    std::remove(store.path(location).c_str());
+    yr::YrForecastSeries series =
+        yr::YrForecast::parseForecastSeries(readTestData("test_weather_data.txt"));
+    ASSERT_TRUE(store.append(location, series));
+    // Let only part of the next block reach the file
+    std::ifstream file(store.path(location), std::ios::binary | std::ios::ate);
+    rlim_t size = static_cast<rlim_t>(file.tellg());
+    file.close();
+    rlimit saved;
+    getrlimit(RLIMIT_FSIZE, &saved);
+    signal(SIGXFSZ, SIG_IGN);
+    rlimit limited = saved;
+    limited.rlim_cur = size + 50;
+    setrlimit(RLIMIT_FSIZE, &limited);
+    series.issue_time += 3600;
+    bool appended = store.append(location, series);
+    setrlimit(RLIMIT_FSIZE, &saved);
+    signal(SIGXFSZ, SIG_DFL);
+    EXPECT_FALSE(appended);
+    series.issue_time += 3600;
+    EXPECT_TRUE(store.append(location, series));
+    std::vector<yr::YrForecastSeries> runs = store.read(location, 0, INT64_MAX);
+    ASSERT_EQ(runs.size(), 2u);
+    EXPECT_TRUE(sameBits(runs[1], series));
+    std::remove(store.path(location).c_str());
+}
+TEST(TestHistoryStore, When_BlockSizesCorrupt_Expect_ScanEnds){
+    std::string directory = testing::TempDir() + "yr_history_test";
+    yr::HistoryStore store(directory);
+    yr::ForecastLocation location = {1.0f, 2.0f, 4};
+    yr::YrForecastSeries series =
+        yr::YrForecast::parseForecastSeries(readTestData("test_weather_data.txt"));
+    // Point count, then payload length, of the first block
+    for (size_t field : {12u, 16u})
+    {
+        std::remove(store.path(location).c_str());
+        ASSERT_TRUE(store.append(location, series));
+        ASSERT_TRUE(store.append(location, series));
+        {
+            std::fstream file(store.path(location), std::ios::binary | std::ios::in | std::ios::out);
+            file.seekp(field);
+            file.write("\xff\xff\xff\x7f", 4);
+        }
+        EXPECT_TRUE(store.read(location, 0, INT64_MAX).empty());
+    }
+    std::remove(store.path(location).c_str());
+}
+TEST(TestHistoryStore, When_SeriesEncoded_Expect_SmallerThanCompressedJSON){
+    std::string data = readTestData("test_weather_data.txt");
+    yr::YrForecastSeries series = yr::YrForecast::parseForecastSeries(data);
+    std::string payload = yr::HistoryStore::encodeSeries(series);
+    // The store keeps only the seven fields of YrForecastPoint, compare
+    // against the response cut down to those fields
+    nlohmann::json full = nlohmann::json::parse(data);
+    nlohmann::json kept;
+    kept["properties"]["meta"]["updated_at"] = full["properties"]["meta"]["updated_at"];
+    for (const auto &entry : full["properties"]["timeseries"])
+    {
+        nlohmann::json step;
+        step["time"] = entry["time"];
+        step["data"]["instant"]["details"] = entry["data"]["instant"]["details"];
+        if (entry["data"].contains("next_6_hours"))
+        {
+            step["data"]["next_6_hours"]["details"]["precipitation_amount"] =
+                entry["data"]["next_6_hours"]["details"]["precipitation_amount"];
+        }
+        kept["properties"]["timeseries"].push_back(step);
+    }
+    std::string same_fields = kept.dump();
+    uLongf compressed_size = compressBound(same_fields.size());
+    std::string compressed(compressed_size, '\0');
+    ASSERT_EQ(compress2(reinterpret_cast<Bytef *>(&compressed[0]), &compressed_size,
+                        reinterpret_cast<const Bytef *>(same_fields.data()), same_fields.size(),
+                        Z_DEFAULT_COMPRESSION), Z_OK);
+    // 568 bytes against 1991 on the test data
+    EXPECT_LT((payload.size() + 20) * 3, compressed_size);
+    yr::YrForecastSeries decoded;
+    decoded.issue_time = series.issue_time;
+    ASSERT_TRUE(yr::HistoryStore::decodeSeries(payload, series.points.size(), decoded));
+    EXPECT_TRUE(sameBits(decoded, series));
+    EXPECT_FALSE(yr::HistoryStore::decodeSeries(payload.substr(0, payload.size() / 2),
+                                                series.points.size(), decoded));
+}
+// Test data with the extra fields of the complete product added to every step
+static std::string completeForecastBody(){
+    nlohmann::json forecast = nlohmann::json::parse(readTestData("test_weather_data.txt"));
+    int step = 0;
+    for (auto &entry : forecast["properties"]["timeseries"])
+    {
+        nlohmann::json &details = entry["data"]["instant"]["details"];
+        float temperature = details["air_temperature"];
+        details["dew_point_temperature"] = temperature - 2.5;
+        details["fog_area_fraction"] = 0;
+        details["ultraviolet_index_clear_sky"] = step * 0.1;
+        details["wind_speed_of_gust"] = 9.5;
+        details["air_temperature_percentile_10"] = temperature - 1;
+        details["air_temperature_percentile_90"] = temperature + 1;
+        if (entry["data"].contains("next_1_hours"))
+        {
+            entry["data"]["next_1_hours"]["details"]["precipitation_amount_max"] = 1.5;
+        }
+        step++;
+    }
+    return forecast.dump();
+}
+TEST(TestForecastProjection, When_FieldsRequested_Expect_OnlyThoseExtracted){
+    std::string data = completeForecastBody();
+    yr::YrForecastSeries series = yr::YrForecast::parseForecastSeries(data);
+    yr::ForecastProjection projection({"dew_point_temperature", "instant.air_temperature",
+        "next_1_hours.precipitation_amount_max", "next_6_hours.precipitation_amount",
+        "air_temperature", "not_a_field"});
+    yr::ProjectedForecast projected = projection.parse(data);
+    EXPECT_EQ(projected.issue_time, series.issue_time);
+    ASSERT_EQ(projected.steps(), series.points.size());
+    ASSERT_EQ(projected.values.size(), projected.steps() * 6);
+    for (size_t i = 0; i < projected.steps(); i++)
+    {
+        EXPECT_EQ(projected.times[i], series.points[i].time);
+        EXPECT_FLOAT_EQ(projected.value(i, 0), series.points[i].temperature - 2.5f);
+        EXPECT_EQ(projected.value(i, 1), series.points[i].temperature);
+        EXPECT_EQ(projected.value(i, 4), series.points[i].temperature);
+        EXPECT_TRUE(std::isnan(projected.value(i, 5)));
+        if (std::isnan(series.points[i].precipitation_amount))
+        {
+            EXPECT_TRUE(std::isnan(projected.value(i, 3)));
+        }
+        else
+        {
+            EXPECT_EQ(projected.value(i, 3), series.points[i].precipitation_amount);
+        }
+    }
+    // Hourly steps come first, the later ones have no next_1_hours
+    EXPECT_EQ(projected.value(0, 2), 1.5f);
+    EXPECT_TRUE(std::isnan(projected.value(projected.steps() - 1, 2)));
+}
+TEST(TestForecastProjection, When_MaxSteps_Expect_ReadingStopsEarly){
+    std::string data = completeForecastBody();
+    yr::ForecastProjection projection({"ultraviolet_index_clear_sky"}, 3);
+    yr::ProjectedForecast projected = projection.parse(data);
+    ASSERT_EQ(projected.steps(), 3u);
+    EXPECT_FLOAT_EQ(projected.value(2, 0), 0.2f);
+    // Truncated after the steps wanted still parses
+    EXPECT_EQ(projection.parse(data.substr(0, data.size() / 2)).steps(), 3u);
+    EXPECT_THROW(yr::ForecastProjection({"air_temperature"}).parse(data.substr(0, data.size() / 2)),
+                 std::runtime_error);
+    EXPECT_THROW(yr::ForecastProjection({"next_2_hours.precipitation_amount"}),
+                 std::invalid_argument);
+}
+TEST(TestFetchForecastData, When_Recorded_Expect_ReplayedWithoutServer){
+    std::string path = testing::TempDir() + "yr_archive_fetch.yra";
+    std::string url;
+    {
+        StubHttpServer stub([](int)
+        {
+            StubHttpServer::Reply reply = {0, 200, "{\"recorded\":true}"};
+            return reply;
+        });
+        url = stub.url();
+        yr::YrForecast recorder(50, 50, 50);
+        yr::FetchOptions options;
+        options.record = std::make_shared<yr::ArchiveWriter>(path);
+        recorder.setFetchOptions(options);
+        CURL *handle = curl_easy_init();
+        EXPECT_TRUE(recorder.fetchForecastData(url, handle).ok());
+        curl_easy_cleanup(handle);
+        options.record->close();
+    }
+    // Stub server is gone, answers come from the archive
+    yr::YrForecast replayer(50, 50, 50);
+    yr::FetchOptions options;
+    options.replay = std::make_shared<yr::ArchiveReader>(path);
+    options.replay_speed = 0;
+    replayer.setFetchOptions(options);
+    yr::FetchResult result = replayer.fetchForecastData(url, NULL);
+    EXPECT_TRUE(result.ok());
+    EXPECT_EQ(result.body, "{\"recorded\":true}");
+    EXPECT_EQ(result.http_status, 200);
+    // Headers are kept with the body
+    {
+        yr::ArchiveRecord record;
+        ASSERT_TRUE(options.replay->read(0, record));
+        EXPECT_EQ(record.headers.find("HTTP/1.1 200"), 0u);
+    }
+    EXPECT_EQ(replayer.fetchForecastData(url + "?other", NULL).status, yr::FetchStatus::ReplayMiss);
+    std::remove(path.c_str());
+}
+
+TEST(TestFetchForecast, When_FetchOptionsDiffer_Expect_NotCoalesced){
+    std::string path = testing::TempDir() + "yr_archive_flight.yra";
+    yr::YrForecast leader(50, 50, 50);
+    leader.createURL();
+    {
+        yr::ArchiveWriter writer(path);
+        yr::ArchiveRecord record;
+        record.url = leader.getURL();
+        record.http_status = 200;
+        record.duration_ms = 300;
+        record.body = readTestData("test_weather_data.txt");
+        writer.append(record);
+    }
+    yr::FetchOptions options;
+    options.replay = std::make_shared<yr::ArchiveReader>(path);
+    leader.setFetchOptions(options);
+    yr::YrForecast same(50, 50, 50);
+    same.setFetchOptions(options);
+    yr::YrForecast other(50, 50, 50);
+    options.max_attempts = 1;
+    other.setFetchOptions(options);
+
+    yr::SingleFlightStats before = yr::YrForecast::singleFlightStats();
+    std::thread first([&leader]() { EXPECT_EQ(leader.fetchForecast().temperature, -6); });
+    // Both join while the replayed response is still in flight
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::thread second([&same]() { EXPECT_EQ(same.fetchForecast().temperature, -6); });
+    std::thread third([&other]() { EXPECT_EQ(other.fetchForecast().temperature, -6); });
+    first.join();
+    second.join();
+    third.join();
+    yr::SingleFlightStats after = yr::YrForecast::singleFlightStats();
+    EXPECT_EQ(after.executions - before.executions, 2u);
+    EXPECT_EQ(after.coalesced - before.coalesced, 1u);
+    std::remove(path.c_str());
+}
+
+// Test the bounded queue
+TEST(TestBoundedQueue, When_Full_Expect_PushRefusedAndFifoOrder){
+    yr::BoundedQueue<int> queue(3);
+    // Rounded up to a power of two
+    EXPECT_EQ(queue.capacity(), 4u);
+    for (int i = 0; i < 4; i++)
+    {
+        EXPECT_TRUE(queue.tryPush(i));
+    }
+    int extra = 4;
+    EXPECT_FALSE(queue.tryPush(extra));
+    int item = -1;
+    for (int i = 0; i < 4; i++)
+    {
+        EXPECT_TRUE(queue.tryPop(item));
+        EXPECT_EQ(item, i);
+    }
+    EXPECT_FALSE(queue.tryPop(item));
+}
+// Test the work-stealing pool
+TEST(TestWorkStealingPool, When_WorkerBlocked_Expect_QueuedTasksStolen){
+    const int tasks = 32;
+    std::atomic<int> completed{0};
+    yr::WorkStealingPool pool(2, 4);
+    // First task holds its worker until every other task has run, which
+    // only happens if the other worker steals from the blocked one
+    pool.submit([&]()
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (completed < tasks - 1 && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::yield();
+        }
+    });
+    for (int i = 1; i < tasks; i++)
+    {
+        pool.submit([&]() { completed++; });
+    }
+    pool.wait();
+    EXPECT_EQ(completed, tasks - 1);
+    EXPECT_GT(pool.stolen(), 0u);
+}
+// Body in the compact.json layout, temperature set to the latitude
+static std::string stubForecastBody(float latitude)
+{
+    return "{\"properties\":{\"timeseries\":[{\"data\":{\"instant\":{\"details\":{"
+        "\"air_pressure_at_sea_level\":1000.5,\"air_temperature\":" + std::to_string(latitude) + ","
+        "\"cloud_area_fraction\":50,\"relative_humidity\":80,\"wind_from_direction\":90,"
+        "\"wind_speed\":3}},\"next_6_hours\":{\"summary\":{\"symbol_code\":\"rain\"},"
+        "\"details\":{\"precipitation_amount\":1.5}}}}]}}";
+}
+// Test the fetch, parse and publish pipeline
+TEST(TestForecastPipeline, When_BatchRun_Expect_ResultsInOrderWithFailures){
+    yr::PipelineConfig config;
+    config.io_threads = 4;
+    config.parse_workers = 2;
+    // Small queues so the fetch threads hit backpressure
+    config.queue_capacity = 1;
+    yr::ForecastPipeline pipeline(config, [](const yr::ForecastLocation &location)
+    {
+        if (location.altitude == 13)
+        {
+            throw std::runtime_error("timeout");
+        }
+        if (location.altitude == 14)
+        {
+            return std::string("not json");
+        }
+        return stubForecastBody(location.latitude);
+    });
+    std::vector<yr::ForecastLocation> locations;
+    for (int i = 0; i < 100; i++)
+    {
+        yr::ForecastLocation location = {static_cast<float>(i % 80), 10, i};
+        locations.push_back(location);
+    }
+    std::vector<yr::PipelineResult> results = pipeline.run(locations);
+
+    ASSERT_EQ(results.size(), locations.size());
+    for (int i = 0; i < 100; i++)
+    {
+        EXPECT_EQ(results[i].index, static_cast<size_t>(i));
+        if (i == 13 || i == 14)
+        {
+            EXPECT_FALSE(results[i].success);
+            EXPECT_FALSE(results[i].error.empty());
+            continue;
+        }
+        EXPECT_TRUE(results[i].success);
+        EXPECT_EQ(results[i].forecast.temperature, static_cast<float>(i % 80));
+        EXPECT_EQ(results[i].forecast.precipitation_amount, 1.5);
+    }
+    yr::PipelineStats stats = pipeline.stats();
+    EXPECT_EQ(stats.fetched, 99u);
+    EXPECT_EQ(stats.parsed, 98u);
+    EXPECT_EQ(stats.failed, 2u);
+}
+TEST(TestForecastPipeline, When_FetcherAndSinkThrowAnything_Expect_BatchCompletes){
+    yr::PipelineConfig config;
+    config.io_threads = 2;
+    config.parse_workers = 1;
+    yr::ForecastPipeline pipeline(config, [](const yr::ForecastLocation &location) -> std::string
+    {
+        if (location.altitude % 2 == 0)
+        {
+            throw 42;
+        }
+        return stubForecastBody(location.latitude);
+    });
+    std::vector<yr::ForecastLocation> locations;
+    for (int i = 0; i < 10; i++)
+    {
+        yr::ForecastLocation location = {1, 10, i};
+        locations.push_back(location);
+    }
+    std::atomic<int> published{0};
+    pipeline.run(locations, [&published](const yr::PipelineResult &result)
+    {
+        published++;
+        if (!result.success)
+        {
+            throw std::runtime_error("sink failed");
+        }
+    });
+    EXPECT_EQ(published, 10);
+    EXPECT_EQ(pipeline.stats().failed, 5u);
+}
+
+#ifdef YR_FORECAST_SERVER
+// Test the local forecast server
+// Connect to the server on localhost
+static int connectLocal(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address));
+    return fd;
+}
+// Read one full response, anything after it is left in pending
+static std::string readResponse(int fd, std::string &pending)
+{
+    char buffer[4096];
+    while (true)
+    {
+        size_t head_end = pending.find("\r\n\r\n");
+        if (head_end != std::string::npos)
+        {
+            size_t length_pos = pending.find("Content-Length: ");
+            size_t length = std::stoul(pending.substr(length_pos + 16));
+            size_t total = head_end + 4 + length;
+            if (pending.size() >= total)
+            {
+                std::string response = pending.substr(0, total);
+                pending.erase(0, total);
+                return response;
+            }
+        }
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if (received <= 0)
+        {
+            return "";
+        }
+        pending.append(buffer, received);
+    }
+}
+static yr::YrForecastStruct fakeForecast()
+{
+    yr::YrForecastStruct weather;
+    weather.air_pressure_at_sea_level = 1041.5;
+    weather.temperature = -6;
+    weather.cloud_area_fraction = 95.3;
+    weather.relative_humidity = 63.4;
+    weather.wind_direction = 98.3;
+    weather.wind_speed = 4.5;
+    weather.precipitation_amount = 0;
+    weather.forecast_summary = "\"cloudy\"";
+    return weather;
+}
+TEST(TestForecastServer, When_SameLocationTwice_Expect_SecondFromCache){
+    std::atomic<int> fetches{0};
+    yr::ForecastServerConfig config;
+    config.port = 0;
+    yr::ForecastServer server(config, [&](float, float, int)
+    {
+        fetches++;
+        return fakeForecast();
+    });
+    ASSERT_TRUE(server.start());
+    int fd = connectLocal(server.port());
+    std::string pending;
+    std::string request = "GET /forecast?lat=50&lon=50&altitude=50 HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    // Both requests on the same keep-alive connection
+    send(fd, request.data(), request.size(), 0);
+    std::string first = readResponse(fd, pending);
+    send(fd, request.data(), request.size(), 0);
+    std::string second = readResponse(fd, pending);
+    close(fd);
+
+    EXPECT_EQ(first.find("HTTP/1.1 200 OK"), 0u);
+    EXPECT_NE(first.find("\"temperature\":-6"), std::string::npos);
+    EXPECT_NE(first.find("\"summary\":\"cloudy\""), std::string::npos);
+    EXPECT_EQ(first, second);
+    EXPECT_EQ(fetches, 1);
+    yr::ForecastServerStats stats = server.stats();
+    EXPECT_EQ(stats.cache_misses, 1u);
+    EXPECT_EQ(stats.cache_hits, 1u);
+    EXPECT_EQ(stats.connections, 1u);
+}
+TEST(TestForecastServer, When_PipelinedRequests_Expect_AnsweredInOrder){
+    yr::ForecastServerConfig config;
+    config.port = 0;
+    yr::ForecastServer server(config, [](float, float, int) { return fakeForecast(); });
+    ASSERT_TRUE(server.start());
+    int fd = connectLocal(server.port());
+    std::string pending;
+    std::string requests =
+        "GET /forecast?lat=1&lon=2 HTTP/1.1\r\n\r\n"
+        "GET /unknown HTTP/1.1\r\n\r\n"
+        "GET /forecast?lat=abc&lon=2 HTTP/1.1\r\n\r\n"
+        "GET /forecast?lat=1&lon=2&altitude=1e30 HTTP/1.1\r\n\r\n"
+        "GET /forecast?lat=1&lon=2 HTTP/1.1\r\nConnection: close\r\n\r\n";
+    send(fd, requests.data(), requests.size(), 0);
+    EXPECT_EQ(readResponse(fd, pending).find("HTTP/1.1 200"), 0u);
+    EXPECT_EQ(readResponse(fd, pending).find("HTTP/1.1 404"), 0u);
+    EXPECT_EQ(readResponse(fd, pending).find("HTTP/1.1 400"), 0u);
+    EXPECT_EQ(readResponse(fd, pending).find("HTTP/1.1 400"), 0u);
+    std::string last = readResponse(fd, pending);
+    EXPECT_EQ(last.find("HTTP/1.1 200"), 0u);
+    EXPECT_NE(last.find("Connection: close"), std::string::npos);
+    // Server closes after the Connection: close request
+    char byte;
+    EXPECT_EQ(recv(fd, &byte, 1, 0), 0);
+    close(fd);
+}
+TEST(TestForecastServer, When_FloodedWhileWaiting_Expect_InputNotBuffered){
+    std::atomic<bool> release{false};
+    yr::ForecastServerConfig config;
+    config.port = 0;
+    yr::ForecastServer server(config, [&](float, float, int)
+    {
+        while (!release)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return fakeForecast();
+    });
+    ASSERT_TRUE(server.start());
+    int fd = connectLocal(server.port());
+    std::string request = "GET /forecast?lat=1&lon=2 HTTP/1.1\r\n\r\n";
+    send(fd, request.data(), request.size(), 0);
+    // Keep sending until the socket buffers fill, which only happens if
+    // the server stops reading while the fetch is outstanding
+    const size_t limit = 256u << 20;
+    std::string junk(65536, 'x');
+    size_t sent_total = 0;
+    int stalls = 0;
+    while (sent_total < limit && stalls < 20)
+    {
+        ssize_t sent = send(fd, junk.data(), junk.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent > 0)
+        {
+            sent_total += sent;
+            stalls = 0;
+        }
+        else
+        {
+            stalls++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    EXPECT_LT(sent_total, limit);
+    release = true;
+    std::string pending;
+    EXPECT_EQ(readResponse(fd, pending).find("HTTP/1.1 200"), 0u);
+    close(fd);
+}
+TEST(TestForecastServer, When_ResponsesNotRead_Expect_SendsStall){
+    yr::ForecastServerConfig config;
+    config.port = 0;
+    config.max_pending_output_bytes = 65536;
+    yr::ForecastServer server(config, [](float, float, int) { return fakeForecast(); });
+    ASSERT_TRUE(server.start());
+    int fd = connectLocal(server.port());
+    // Pipeline requests without reading a single response, the server
+    // must stop reading once its unsent responses pass the limit
+    const size_t limit = 32u << 20;
+    std::string requests;
+    while (requests.size() < 65536)
+    {
+        requests += "GET /forecast?lat=1&lon=2 HTTP/1.1\r\n\r\n";
+    }
+    size_t sent_total = 0;
+    int stalls = 0;
+    while (sent_total < limit && stalls < 50)
+    {
+        // Carry on from where the last send stopped so requests stay whole
+        size_t offset = sent_total % requests.size();
+        ssize_t sent = send(fd, requests.data() + offset, requests.size() - offset,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent > 0)
+        {
+            sent_total += sent;
+            stalls = 0;
+        }
+        else
+        {
+            stalls++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+    }
+    EXPECT_LT(sent_total, limit);
+    // Held back requests are answered once the client reads again
+    std::string pending;
+    for (int i = 0; i < 100; i++)
+    {
+        ASSERT_EQ(readResponse(fd, pending).find("HTTP/1.1 200"), 0u);
+    }
+    close(fd);
+}
+TEST(TestForecastServer, When_FetchFails_Expect_BadGatewayNotCached){
+    std::atomic<int> fetches{0};
+    yr::ForecastServerConfig config;
+    config.port = 0;
+    yr::ForecastServer server(config, [&](float, float, int) -> yr::YrForecastStruct
+    {
+        fetches++;
+        throw std::runtime_error("timeout");
+    });
+    ASSERT_TRUE(server.start());
+    int fd = connectLocal(server.port());
+    std::string pending;
+    std::string request = "GET /forecast?lat=1&lon=2 HTTP/1.1\r\n\r\n";
+    send(fd, request.data(), request.size(), 0);
+    EXPECT_EQ(readResponse(fd, pending).find("HTTP/1.1 502"), 0u);
+    send(fd, request.data(), request.size(), 0);
+    EXPECT_EQ(readResponse(fd, pending).find("HTTP/1.1 502"), 0u);
+    close(fd);
+    EXPECT_EQ(fetches, 2);
+    EXPECT_EQ(server.stats().fetch_errors, 2u);
+}
+#endif
 
 // Death tests
 
@@ -201,23 +1251,6 @@ TEST(MyDeathTest, When_Emptytring_Expect_NlohmanException){
     EXPECT_ANY_THROW(test_forecast.parseForecastJSON(empty_string));
 }
 
-TEST(MyDeathTest, When_CurlHandleNullPointer_Expect_Exit){
-    // Set up yr object
-    int test_lat = 50;
-    int test_lon =50; 
-    int test_alt = 50;
-    yr::YrForecast test_forecast(test_lat, test_lon, test_alt);
-    // Create URL sets _URL_complete true
-    test_forecast.createURL();
-    std::string url = test_forecast.getURL();
-    CURLcode test_code;
-    CURL *test_easyhandle = NULL;
-    std::string matcher = "";
-    // Expected to exit
-    EXPECT_EXIT(test_forecast.populateForecastData(url,test_easyhandle, test_code),
-        testing::ExitedWithCode(EXIT_FAILURE), matcher);
-
-}
 TEST(MyDeathTest, When_TestLonOutOfBoundsInt_Expect_Exit){
     // Set up handleCoords object
     int test_lon = 400;